@@ -1,52 +1,650 @@
+#define _GNU_SOURCE //Writer-preferring rwlocks
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#ifdef INSTRUMENT
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
 
-#define ORDER 4
+#ifndef DEFAULT_ORDER
+#define DEFAULT_ORDER 64 //Fanout used when --order is not given
+#endif
+#define MIN_ORDER 3
+#define MAX_ORDER 1024
+#define CACHE_LINE_SIZE 64
+#define MAX_TREE_HEIGHT 64
+#define ARENA_MIN_CHUNK (64 * 1024)
+#define ARENA_MAX_CHUNK (4 * 1024 * 1024)
 #define MAX_LINE_LEN 100
-#define HEAP_SIZE 7500 
-#define SECONDARY_STORAGE_SIZE 2500
+#define CSV_MAX_FIELDS 8
+#define RUN_BUFFER_SIZE (256 * 1024) //stdio buffer for each run file
+#define MIN_CHUNK_BYTES (64 * 1024) //Smallest input range worth its own run-generation thread
+#define MIN_HEAP_ENTRIES 16
+#define BUILD_SEGMENT_RECORDS 8192 //Merged records handed to a parallel build worker at a time, rounded up to a department boundary
+#define DEFAULT_BATCH_SIZE 4096
+#define BATCH_MAX_LEAF_HOPS 4 //Leaf-chain steps before a batch query descends from the root again
+#define PREFIX_SCAN_WIDTH 8 //Keys counted linearly once the prefix binary search has narrowed the node
+#define INDEX_PAGE_SIZE 4096
+#define INDEX_MAGIC 0x58444950u //"PIDX"
+#define INDEX_VERSION 1
+#define SKIP_MAX_LEVEL 20 //Enough for 4^20 entries per department
+#define DEFAULT_SORT_BUDGET (16 * 1024 * 1024) //External sort memory when --memory-budget is not given
+#define DEFAULT_RANK_CACHE_SIZE 4096 //(department, rank) results cached when --cache-size is not given
+#define RANK_CACHE_WAYS 4
+#define ZIPF_RANK_DEPTH 10 //Ranks drawn by the skewed benchmark
 
-//Linked List Node
+//Build with -DINSTRUMENT to count hot-path operations for --report; otherwise
+//COUNT and SET_SORT_PHASE compile to nothing
+#ifdef INSTRUMENT
+#define COUNT(counter, n) __atomic_fetch_add(&instrument.counter, (uint64_t)(n), __ATOMIC_RELAXED)
+#define SET_SORT_PHASE(phase) (sort_phase = (phase))
+#define HW_EVENTS 4
+enum { SORT_RUN_GENERATION, SORT_MERGE_PASSES, SORT_FINAL_MERGE, SORT_PHASES };
+#else
+#define COUNT(counter, n) ((void)0)
+#define SET_SORT_PHASE(phase) ((void)0)
+#endif
+
+//Skip list link; width is the number of level-0 steps the link jumps over
+typedef struct SkipLink {
+    struct UniversityNode* next;
+    int width;
+} SkipLink;
+
+//Skip list node: links[0].next walks the department ranking in order
 typedef struct UniversityNode {
     char university_name[MAX_LINE_LEN];
     float score;
-    struct UniversityNode* next;
+    int level;
+    SkipLink links[];
 } UniversityNode;
 
+//Department ranking: an indexable skip list in descending score order (equal
+//scores by university name), so ordered insertion and rank-k lookup take
+//O(log n) expected time
+typedef struct RankList {
+    int count;
+    int level;
+    uint32_t key; //KeyRef of the department
+    uint32_t version; //Bumped on every change, so cached ranks of the department go stale
+    SkipLink head[SKIP_MAX_LEVEL];
+} RankList;
+
+//Tail of a RankList being filled in rank order: the last link on every level
+typedef struct RankListAppender {
+    RankList* list;
+    SkipLink* last[SKIP_MAX_LEVEL];
+    int last_rank[SKIP_MAX_LEVEL];
+} RankListAppender;
+
+//Offset of a NUL-terminated department name inside key_store
+typedef uint32_t KeyRef;
+
+//Shared, append-only storage for every key referenced by the tree
+typedef struct KeyStore {
+    char* data;
+    size_t used;
+    size_t capacity;
+} KeyStore;
+
+//Open-addressing (linear probing) slot of the department hash index. The full
+//hash is kept so probes rarely touch the key string; list == NULL marks a free slot.
+typedef struct DeptHashSlot {
+    uint32_t hash;
+    KeyRef key;
+    RankList* list;
+} DeptHashSlot;
+
+//Department name -> ranking, alongside the tree. Rankings never move when
+//nodes split, so the map stays valid through every insert and bulk load.
+typedef struct DeptHash {
+    DeptHashSlot* slots;
+    size_t capacity; //Power of two
+    size_t count;
+} DeptHash;
+
+//A program offered by a university: its entry in a department's ranking
+typedef struct UniProgram {
+    KeyRef dept; //list->key; each department has exactly one, so handles compare like names
+    RankList* list;
+    UniversityNode* uni;
+} UniProgram;
+
+//University index slot: the university's programs sorted by department handle.
+//programs == NULL marks a free slot.
+typedef struct UniEntry {
+    uint32_t hash;
+    KeyRef name;
+    int count;
+    int capacity;
+    UniProgram* programs;
+} UniEntry;
+
+//Secondary index from university name to programs, open addressing like DeptHash
+typedef struct UniIndex {
+    UniEntry* slots;
+    size_t capacity; //Power of two
+    size_t count;
+    size_t program_bytes;
+} UniIndex;
+
+//Score index entry: one program, linked into a skip list over all departments
+typedef struct ScoreNode {
+    UniversityNode* uni;
+    RankList* list;
+    int level;
+    struct ScoreNode* next[];
+} ScoreNode;
+
+//Secondary index over every program in descending score order (equal scores by
+//department, then university), for score-range and top-N scans across departments
+typedef struct ScoreIndex {
+    ScoreNode* head[SKIP_MAX_LEVEL];
+    int level;
+    long count;
+    size_t bytes;
+} ScoreIndex;
+
+//A program in load order while the bulk loader sorts the score index
+typedef struct ScoreEntry {
+    UniversityNode* uni;
+    RankList* list;
+    long position;
+} ScoreEntry;
+
+#ifdef INSTRUMENT
+//Operation counts, bumped atomically since sort workers and query threads share them
+typedef struct Instrumentation {
+    uint64_t find_leaf_calls;
+    uint64_t nodes_visited;   //Including the leaf
+    uint64_t key_comparisons; //strcmp/strncmp against node keys
+    uint64_t prefix_searches; //Fingerprint searches that narrowed a node before strcmp
+    uint64_t rank_queries;
+    uint64_t list_hops;       //Skip list links followed by rank queries
+    uint64_t sort_bytes_read[SORT_PHASES];
+    uint64_t sort_bytes_written[SORT_PHASES];
+    uint64_t hw[HW_EVENTS];   //Hardware counter readings
+} Instrumentation;
+#endif
+
+//A (department, university) pair sampled from the input for the concurrency benchmark
+typedef struct SampleQuery {
+    char dept_name[MAX_LINE_LEN];
+    char uni_name[MAX_LINE_LEN];
+} SampleQuery;
+
+//One query thread of the concurrency benchmark; it runs ops queries, or until
+//the loader finishes when ops is 0
+typedef struct ReaderWorker {
+    const SampleQuery* samples;
+    long sample_count;
+    long first; //Starting sample, so threads do not walk the samples in lockstep
+    long ops;
+    long completed;
+    long hits;
+} ReaderWorker;
+
+//Key bytes the tree would hold if nodes stored keys inline, with and without
+//the per-node shared prefix, and separator bytes with and without truncation
+typedef struct KeyStats {
+    size_t inline_bytes;
+    size_t compressed_bytes;
+    size_t separator_full_bytes;
+    size_t separator_bytes;
+} KeyStats;
+
 //B+Tree Node
+//A node holds at most tree_order - 1 keys. The prefix, pointer and key arrays live
+//in the same cache-line-aligned block as the header and have one spare slot each,
+//so a node can overflow by one entry before it is split.
 typedef struct Node {
     bool is_leaf;
     int num_keys;
-    char keys[ORDER - 1][MAX_LINE_LEN];
-    void* pointers[ORDER];
+    int prefix_len;     //Bytes every key of the node shares, i.e. the common prefix of the first and last key
+    uint64_t* prefixes; //key_prefix of every key past the shared bytes, searched before the strings themselves
+    KeyRef* keys;
+    void** pointers;
     struct Node* parent;
     struct Node* next;
 } Node;
 
+//State of a bottom-up bulk build: the open (rightmost) node on every level
+typedef struct TreeBuilder {
+    Node* spine[MAX_TREE_HEIGHT];
+    int height;
+    int leaf_fill;     //Keys per leaf before a new leaf is started
+    int internal_fill; //Keys per internal node before a new one is started
+} TreeBuilder;
+
+//How a bulk load splits the sort and packs the tree. run_bulk_loading takes it
+//from the command line; the benchmark and self-test pass their own.
+typedef struct BulkOptions {
+    int threads;          //Run generation workers and build threads
+    double leaf_fill;     //Share of a leaf filled before the next one is started
+    double internal_fill; //The same for internal nodes
+    bool single_run;      //Merge down to one run first, so the build does no merging
+} BulkOptions;
+
+//New departments waiting to be merged into the leaf the delta pass is on.
+//Keys below upper (when bounded) descend to leaf.
+typedef struct DeltaCursor {
+    Node* leaf;
+    KeyRef upper;
+    bool bounded;
+    RankList** pending; //Ascending, all inside the leaf's key range
+    int pending_count;
+    int pending_capacity;
+} DeltaCursor;
+
+//What the delta merges applied so far changed
+typedef struct DeltaStats {
+    long rows;
+    long inserted;
+    long updated;
+    long unchanged;
+    long new_departments;
+    long leaves_touched;
+    long leaves_added;
+    double seconds;
+} DeltaStats;
+
+//A cached rank query: the answer (NULL past the end of the ranking) and the
+//version of the ranking it was read from
+typedef struct RankCacheEntry {
+    RankList* list; //NULL for a free way
+    UniversityNode* uni;
+    uint32_t hash;  //Of the department name
+    uint32_t version;
+    int rank;
+    bool referenced; //CLOCK bit
+} RankCacheEntry;
+
+//Set-associative (department, rank) result cache; each set of RANK_CACHE_WAYS
+//entries is replaced by its own CLOCK hand
+typedef struct RankCache {
+    RankCacheEntry* entries;
+    uint8_t* hands;
+    size_t set_count;
+    long long hits;
+    long long misses;
+    long long evictions;
+    long long invalidations; //Entries found stale because their department changed
+} RankCache;
+
+//What the deletions applied so far removed
+typedef struct DeleteStats {
+    long rows;
+    long deleted;
+    long departments_removed;
+    double seconds;
+} DeleteStats;
+
+//Node and key counts per level kind, for checking fill bounds after churn
+typedef struct FillStats {
+    long leaves;
+    long leaf_keys;
+    long internals;
+    long internal_keys;
+    long underfull; //Non-root nodes below the minimum a delete restores
+} FillStats;
+
+//Programs to delete and update in the churn phase of the benchmark and self-test
+typedef struct ChurnPlan {
+    char (*names)[MAX_LINE_LEN];
+    KeyRef* owners; //Department of each program
+    float* scores;
+    long programs;
+} ChurnPlan;
+
+//Index file header, stored at the start of page 0
+typedef struct IndexHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t page_size;
+    uint32_t order;
+    uint32_t height;
+    uint32_t root_page;
+    uint32_t first_leaf_page;
+    uint32_t node_pages;      //Pages 1..node_pages hold nodes
+    uint64_t string_offset;   //File offset of the string pool
+    uint64_t string_bytes;
+    uint64_t entry_offset;    //File offset of the PagedEntry array
+    uint64_t entry_count;
+    uint64_t file_size;
+    uint32_t body_checksum;   //CRC-32 of everything after page 0
+    uint32_t header_checksum; //CRC-32 of the fields above
+} IndexHeader;
+
+//Node page: this header, order - 1 key offsets into the string pool, then either
+//order child page ids (internal) or order - 1 PagedValue ranges (leaf)
+typedef struct PagedNode {
+    uint32_t is_leaf;
+    uint32_t num_keys;
+    uint32_t next_page; //Next leaf, 0 at the end of the chain
+    uint32_t reserved;
+} PagedNode;
+
+//A department's ranking: entries[first_entry .. first_entry + count) in rank order
+typedef struct PagedValue {
+    uint32_t first_entry;
+    uint32_t count;
+} PagedValue;
+
+typedef struct PagedEntry {
+    uint32_t name_offset;
+    float score;
+} PagedEntry;
+
+//An index file mapped for queries
+typedef struct PagedIndex {
+    const uint8_t* base;
+    size_t size;
+    const IndexHeader* header;
+    const char* strings;
+    const PagedEntry* entries;
+} PagedIndex;
+
+//Node of a frozen snapshot. Its keys are keys[first_key .. first_key + num_keys)
+//of the snapshot; first_child is the node index of child 0 for internal nodes
+//and the index of the first department for leaves.
+typedef struct FrozenNode {
+    uint32_t first_key;
+    uint16_t num_keys;
+    uint16_t prefix_len;
+    uint32_t first_child;
+} FrozenNode;
+
+//Read-only copy of the tree in a few contiguous arrays addressed by index: the
+//nodes in level order (a node's children are consecutive and the leaves come
+//last), their keys packed back to back as string offsets with fingerprints
+//beside them, one deduplicated string pool, and each department's ranking as
+//a slice of one entry array. Layout matches the index file without the pages.
+typedef struct FrozenTree {
+    uint32_t height;
+    uint32_t node_count;
+    uint32_t leaf_count;
+    uint32_t key_count;
+    uint32_t department_count;
+    uint32_t entry_count;
+    FrozenNode* nodes;
+    uint32_t* keys;
+    uint64_t* prefixes;
+    PagedValue* departments; //In key order
+    PagedEntry* entries;
+    char* strings;
+    size_t string_bytes;
+} FrozenTree;
+
+//State while saving an index: the output, the deduplicated string pool and its hash slots
+typedef struct IndexWriter {
+    FILE* file;
+    IndexHeader header;
+    KeyStore strings;
+    uint32_t* slots;
+    size_t slot_count;
+    size_t string_count;
+    size_t written; //Bytes written after page 0
+    uint32_t checksum;
+} IndexWriter;
+
+//Bump allocator: objects are carved out of large chunks and released all at once
+typedef struct ArenaChunk {
+    struct ArenaChunk* next;
+    size_t size;
+    size_t used;
+} ArenaChunk;
+
+typedef struct Arena {
+    ArenaChunk* head;
+    size_t reserved; //Bytes obtained from the system, including chunk headers
+} Arena;
+
 Node* root = NULL;
 Node* first_leaf = NULL;
+int tree_order = DEFAULT_ORDER;
+size_t node_size = 0; //Bytes of one node block for the current tree_order
+KeyStore key_store = {NULL, 0, 0};
+double leaf_fill_factor = 1.0;
+double internal_fill_factor = 1.0;
+PagedIndex paged_index = {NULL, 0, NULL, NULL, NULL};
+FrozenTree frozen_tree; //Queries use it once nodes is set
+bool use_arena = true;
+bool use_key_prefixes = true;
+bool truncate_separators = true;
+bool use_hash_index = true;
+DeptHash dept_hash = {NULL, 0, 0};
+bool use_university_index = true;
+UniIndex uni_index = {NULL, 0, 0, 0};
+bool use_score_index = true;
+ScoreIndex score_index = {{NULL}, 0, 0, 0};
+size_t rank_cache_size = DEFAULT_RANK_CACHE_SIZE; //Entries; 0 disables the cache
+RankCache rank_cache = {NULL, NULL, 0, 0, 0, 0, 0};
+bool concurrent_mode = false; //Queries and insert() serialize on the global tree_lock
+pthread_rwlock_t tree_lock;
+int loader_done = 0;
+DeltaStats delta_stats = {0, 0, 0, 0, 0, 0, 0, 0};
+DeleteStats delete_stats = {0, 0, 0, 0};
+#ifdef INSTRUMENT
+Instrumentation instrument;      //Running totals
+Instrumentation instrument_load; //Totals when loading finished
+int sort_phase = SORT_RUN_GENERATION;
+int hw_fds[HW_EVENTS] = {-1, -1, -1, -1};
+const char* hw_names[HW_EVENTS] = {"cycles", "instructions", "cache_misses", "branch_misses"};
+#endif
+Arena node_arena = {NULL, 0};
+Arena uni_arena = {NULL, 0};
 
 
 typedef struct Record {
     char uni_name[MAX_LINE_LEN];
     char dept_name[MAX_LINE_LEN];
     float score;
+    uint64_t position; //Byte offset of the row in the input, used as the final tie-break
 } Record;
 
-typedef struct MinHeapNode {
+//Read-only view of a CSV file, memory-mapped when possible
+typedef struct CsvReader {
+    const char* data;
+    size_t size;
+    size_t pos;
+    size_t end;
+    bool mapped;
+} CsvReader;
+
+//A field inside CsvReader::data; nothing is copied until csv_field_copy
+typedef struct CsvField {
+    const char* start;
+    size_t len;
+    bool escaped; //Quoted field that still contains "" pairs
+} CsvField;
+
+//Run file opened with its own large stdio buffer
+typedef struct RunFile {
+    FILE* file;
+    char* buffer;
+    bool corrupt; //A record was cut short, had an impossible length or could not be read
+} RunFile;
+
+//Replacement-selection heap slot; entries tagged with a later run sort after the current run
+typedef struct HeapEntry {
+    int run;
     Record record;
-    int file_index;
-} MinHeapNode;
+} HeapEntry;
+
+//A query of a batch and its answer; type is 'R' (rank in department),
+//'U' (university in department) or 0 for an unparsable line
+typedef struct BatchQuery {
+    char type;
+    char dept_name[MAX_LINE_LEN];
+    char uni_name[MAX_LINE_LEN];
+    int rank;
+    const char* result_name; //NULL when there is no answer
+    float result_score;
+    int result_rank;
+} BatchQuery;
+
+//Lazy scan over the leaf chain: either a [from, to] range or a name prefix.
+//dept_name and list describe the department produced by the last scan_next.
+typedef struct ScanIterator {
+    Node* leaf;
+    int pos;
+    const char* to;     //Inclusive upper bound, NULL when scanning a prefix
+    const char* prefix; //NULL when scanning a range
+    size_t prefix_len;
+    int limit;          //Universities per department, 0 for all
+    const char* dept_name;
+    RankList* list;
+    UniversityNode* current;
+    int rank;
+} ScanIterator;
+
+//One run-generation thread and the byte range of the input it owns
+typedef struct RunWorker {
+    CsvReader reader;
+    int worker_id;
+    int heap_capacity;
+    int run_count;
+    bool failed;
+    double seconds;
+} RunWorker;
+
+//k-way merge over sorted run files driven by a loser tree: tree[0] holds the
+//winning run and tree[1..num_runs-1] the loser of each internal match
+typedef struct RunMerger {
+    int num_runs;
+    RunFile* runs;
+    Record* current;
+    bool* exhausted;
+    int* tree;
+    int first_run;
+    bool failed; //An input was corrupt; no records are handed out after it
+} RunMerger;
+
+//Consecutive departments of the merged stream and the rankings a build worker
+//made from them. Keys go to a private store, rebased into key_store when the
+//segments are stitched together in stream order.
+typedef struct BuildSegment {
+    Record* records;
+    long record_count;
+    KeyStore keys;
+    RankList** lists;
+    long list_count;
+    long list_capacity;
+    Arena arena; //Lists and entries
+    size_t entry_bytes;
+} BuildSegment;
+
+//Hands segments from the merging thread to the build workers. Guarded by lock;
+//at most 2 * threads segments are in flight, which bounds the buffered records.
+typedef struct SegmentQueue {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    BuildSegment** segments;
+    long capacity;
+    long produced;
+    long taken;
+    long finished;
+    bool done;
+} SegmentQueue;
+
+//One level of a parallel bulk build. Node k of the level takes fill entries
+//starting at k * fill (leaves: departments) or k * (fill + 1) children, and
+//separators[k] is the key that goes above it.
+typedef struct LevelBuild {
+    bool leaves;
+    int fill;
+    long count;
+    RankList** lists;
+    long list_count;
+    Node** children;
+    KeyRef* child_separators;
+    long child_count;
+    Node** nodes;
+    KeyRef* separators;
+} LevelBuild;
+
+//The slice [first, last) of a level one thread builds, into its own arena
+typedef struct LevelWorker {
+    LevelBuild* build;
+    long first;
+    long last;
+    Arena arena;
+} LevelWorker;
 
 int total_record = 0;
 long long split_count = 0;
+long long merge_count = 0;
+long long borrow_count = 0;
 long long node_allocations = 0;//For calculating memory usage
 long long uni_node_allocations = 0;
+long long rank_list_allocations = 0;
+size_t uni_node_bytes = 0;
+uint32_t skip_seed = 2463534242u; //Fixed seed keeps node levels reproducible
+int sort_threads = 1;
+size_t sort_memory_budget = DEFAULT_SORT_BUDGET;
+int merge_passes = 0;
+int run_generation_threads = 0;
+int build_threads = 0;
+double run_generation_seconds = 0;
+double merge_build_seconds = 0;
+double merge_pass_seconds = 0; //Multipass merging ahead of the build
+double tree_build_seconds = 0; //The build, which merges the remaining runs as it reads them
+const char* input_file = "yok_atlas.csv";
+long long batch_descents = 0;
+long long batch_leaf_hops = 0;
+volatile long benchmark_sink = 0; //Benchmark results land here so no lookup is optimized away
+long self_test_checks = 0;
+long self_test_failures = 0;
 
 void search_department_by_rank(const char* dept_name, int rank);
+UniversityNode* find_by_rank(const char* dept_name, int rank);
+UniversityNode* find_by_rank_with(const char* dept_name, int rank, bool cached);
+bool search_university(const char* uni_name, const char* dept_name);
+bool search_university_with(const char* uni_name, const char* dept_name, bool use_index);
+bool set_tree_order(int order);
+KeyRef key_store_add(const char* key);
+KeyRef key_store_append(KeyStore* store, const char* key, size_t len);
+void key_store_reserve(KeyStore* store, size_t extra);
+const char* key_str(KeyRef ref);
+void free_key_store();
+uint32_t hash_key(const char* key);
+RankList* dept_hash_find(const char* dept_name);
+void dept_hash_insert(KeyRef key, RankList* list);
+void dept_hash_remove(const char* dept_name);
+void dept_hash_free();
+RankList* find_department(const char* dept_name);
+RankList* find_department_with(const char* dept_name, bool use_hash);
+int node_lower_bound(const Node* node, const char* key);
+int node_lower_bound_with(const Node* node, const char* key, bool prefixes);
+int node_upper_bound(const Node* node, const char* key);
+int node_upper_bound_with(const Node* node, const char* key, bool prefixes);
+uint64_t key_prefix(const char* key);
+int count_prefixes_below(const uint64_t* prefixes, int n, uint64_t prefix, bool inclusive);
+void node_prefix_range(const Node* node, uint64_t prefix, int* first, int* last);
+void node_set_key(Node* node, int i, KeyRef key);
+void node_refresh_prefixes(Node* node);
+KeyRef separator_between(KeyRef left_max, KeyRef right_min);
+void calculate_key_stats(const Node* node, KeyStats* stats);
+void calculate_fill_stats(const Node* node, FillStats* stats);
+uint64_t tree_checksum(const Node* node);
+long count_tree_violations(const Node* node, int depth, int* leaf_depth);
+void* arena_alloc(Arena* arena, size_t size, size_t align);
+void arena_release(Arena* arena);
+void arena_splice(Arena* into, Arena* from);
 
 
 void reset_metrics();
@@ -56,61 +654,526 @@ void insert(const char* dept_name, const char* uni_name, float score);
 void free_tree(Node* node);
 void load_data_from_csv(const char* filename);
 Node* create_node(bool is_leaf);
+Node* create_node_in(Arena* arena, bool is_leaf);
+void free_node(Node* node);
+void free_university(UniversityNode* uni);
 UniversityNode* create_university(const char* name, float score);
-void insert_into_sorted_list(UniversityNode** head, UniversityNode* new_uni);
+UniversityNode* create_university_node(const char* name, float score, int level);
+UniversityNode* create_university_in(Arena* arena, const char* name, float score, int level);
+RankList* create_rank_list();
+RankList* create_rank_list_in(Arena* arena);
+bool ranks_before(const UniversityNode* a, float score, const char* name);
+void rank_list_append_begin(RankListAppender* appender, RankList* list);
+UniversityNode* rank_list_append(RankListAppender* appender, const char* name, float score);
+int rank_list_append_level(const RankList* list);
+void rank_list_append_node(RankListAppender* appender, UniversityNode* new_uni);
+int random_skip_level();
+void insert_into_sorted_list(RankList* list, UniversityNode* new_uni);
+UniversityNode* rank_list_at(const RankList* list, int rank);
+UniversityNode* rank_list_first(const RankList* list);
+int rank_list_rank_of(const RankList* list, const UniversityNode* uni);
+UniversityNode* rank_list_remove_at(RankList* list, int rank);
+void update_score(RankList* list, UniversityNode* uni, float score);
 void run_sequential_insertion();
-void run_bulk_loading();
-int create_sorted_runs_replacement_selection(const char* input_filename);
-void merge_runs(int num_runs);
-void build_tree_from_sorted_file(const char* sorted_filename);
-Node* build_parent_level(Node** children, int count, const char (*keys)[MAX_LINE_LEN]);
+bool run_bulk_loading();
+bool run_bulk_loading_with(const BulkOptions* options);
+int create_sorted_runs_replacement_selection(const char* input_filename, int max_workers);
+void* run_generation_worker(void* arg);
+double wall_clock_seconds();
+bool merge_runs_begin(RunMerger* merger, int first_run, int num_runs);
+int merge_fan_in();
+int merge_runs_multipass(int* first_run, int num_runs, int max_runs);
+void run_file_name(char* buf, int index);
+size_t parse_byte_size(const char* text);
+bool merge_runs_next(RunMerger* merger, Record* out);
+void merge_runs_end(RunMerger* merger);
+bool merge_run_less(const RunMerger* merger, int a, int b);
+int loser_tree_build(RunMerger* merger, int node);
+bool run_file_open(RunFile* run, const char* filename, const char* mode);
+bool run_file_close(RunFile* run);
+bool run_write_record(RunFile* run, const Record* record);
+bool run_read_record(RunFile* run, Record* record);
+void build_tree_from_sorted_runs(RunMerger* merger, const BulkOptions* options);
+void builder_begin(TreeBuilder* builder, const BulkOptions* options);
+void builder_add(TreeBuilder* builder, KeyRef key, RankList* list);
+void builder_append_child(TreeBuilder* builder, int level, KeyRef separator, Node* child);
+void builder_finish(TreeBuilder* builder);
+void build_tree_parallel(RunMerger* merger, const BulkOptions* options);
+void* segment_worker(void* arg);
+void build_segment(BuildSegment* segment);
+void build_levels(RankList** lists, long count, const BulkOptions* options);
+void run_level(LevelBuild* build, int threads);
+void* level_worker(void* arg);
 int compare_records(const void* a, const void* b);
-void swap_heap_nodes(MinHeapNode* a, MinHeapNode* b);
-void min_heapify_merge(MinHeapNode heap_arr[], int size, int i);
-void min_heapify_replacement(Record heap[], int size, int i);
-void swap_records(Record* a, Record* b);
+void min_heapify_replacement(HeapEntry heap[], int size, int i);
+void swap_heap_entries(HeapEntry* a, HeapEntry* b);
+int compare_heap_entries(const HeapEntry* a, const HeapEntry* b);
 Node* find_leaf(Node* current_node, const char* dept_name);
+Node* find_leaf_with(Node* current_node, const char* dept_name, bool prefixes);
 double calculate_average_seek_time(const char* filename);
+uint32_t crc32_update(uint32_t crc, const void* data, size_t len);
+uint32_t index_page_size(int order);
+uint32_t index_intern(IndexWriter* writer, const char* s);
+bool index_write(IndexWriter* writer, const void* data, size_t len);
+bool index_pad_to_page(IndexWriter* writer);
+bool save_index(const char* filename);
+bool paged_index_open(PagedIndex* index, const char* filename, bool verify);
+void paged_index_close(PagedIndex* index);
+const PagedNode* paged_node(const PagedIndex* index, uint32_t page_id);
+const char* paged_string(const PagedIndex* index, uint32_t offset);
+void paged_index_corrupt(const char* what);
+int paged_search_keys(const PagedIndex* index, const PagedNode* node, const char* key, bool upper);
+const PagedValue* paged_find_department(const PagedIndex* index, const char* dept_name);
+bool freeze_tree(FrozenTree* frozen);
+void frozen_tree_free(FrozenTree* frozen);
+size_t frozen_tree_bytes(const FrozenTree* frozen);
+int frozen_bound(const FrozenTree* frozen, const FrozenNode* node, const char* key, bool upper);
+const PagedValue* frozen_find_department(const FrozenTree* frozen, const char* dept_name);
+bool readonly_layout();
+const PagedValue* readonly_find_department(const char* dept_name, const PagedEntry** entries, const char** strings);
+const char* readonly_string(const char* strings, uint32_t offset);
+bool parse_batch_query(char* line, BatchQuery* query);
+int compare_batch_queries(const void* a, const void* b);
+void resolve_in_list(BatchQuery* query, const RankList* list);
+void resolve_in_paged(BatchQuery* query, const PagedValue* value, const PagedEntry* entries, const char* strings);
+void resolve_batch(BatchQuery* queries, BatchQuery** sorted, int count);
+void run_batch_queries(FILE* in, FILE* out, int batch_size);
+void scan_seek(ScanIterator* it, const char* from, int limit);
+void scan_begin_range(ScanIterator* it, const char* from, const char* to, int limit);
+void scan_begin_prefix(ScanIterator* it, const char* prefix, int limit);
+bool scan_next(ScanIterator* it);
+UniversityNode* scan_next_university(ScanIterator* it);
+void print_scan(ScanIterator* it, FILE* out);
+UniEntry* uni_index_find(const char* uni_name);
+UniEntry* uni_index_entry(const char* uni_name);
+int uni_programs_bound(const UniEntry* entry, KeyRef dept, bool lower);
+int compare_programs_by_name(const void* a, const void* b);
+void uni_index_add(UniversityNode* uni, RankList* list);
+void uni_index_remove(const UniversityNode* uni, const RankList* list);
+void uni_index_free();
+void print_university_programs(const char* uni_name, const char* dept_name, FILE* out);
+int compare_program_scores(const UniversityNode* a, const RankList* a_list, const UniversityNode* b, const RankList* b_list);
+ScoreNode* create_score_node(UniversityNode* uni, RankList* list, int level);
+void score_index_insert(UniversityNode* uni, RankList* list);
+void score_index_link(ScoreNode* node);
+ScoreNode* score_index_unlink(const UniversityNode* uni, const RankList* list);
+void score_index_remove(const UniversityNode* uni, const RankList* list);
+int compare_score_entries(const void* a, const void* b);
+void score_index_build();
+ScoreNode* score_index_seek(float max_score);
+void score_index_free();
+void print_score_range(float min_score, float max_score, long limit, FILE* out);
+bool rank_cache_enabled();
+uint32_t rank_cache_set(uint32_t hash, int rank);
+RankCacheEntry* rank_cache_probe(uint32_t hash, const char* dept_name, int rank);
+void rank_cache_fill(uint32_t hash, RankList* list, int rank, UniversityNode* uni);
+void rank_cache_forget(const RankList* list);
+void rank_cache_free();
+UniversityNode* lookup_rank(const char* dept_name, int rank, bool cached, bool* department_found);
+void concurrent_mode_begin();
+void concurrent_mode_end();
+void tree_read_lock();
+void tree_read_unlock();
+void tree_write_lock();
+void tree_write_unlock();
+long sample_queries(const char* filename, SampleQuery* samples, long capacity, uint64_t seed);
+void* reader_worker(void* arg);
+void* loader_worker(void* arg);
+double run_readers(ReaderWorker* workers, int threads, const SampleQuery* samples, long sample_count, long ops);
+int next_thread_count(int threads, int max_threads);
+#ifdef INSTRUMENT
+void instrument_begin();
+void instrument_snapshot(Instrumentation* out);
+void write_report_phase(FILE* out, bool json, const char* phase, const Instrumentation* counts);
+bool write_report(const char* filename, const char* load_name);
+#endif
+bool apply_delta(const char* filename);
+void merge_delta_runs(RunMerger* merger);
+int compare_delta_records(const void* a, const void* b);
+void delta_apply_department(DeltaCursor* cursor, const char* dept_name, Record* group, int count);
+void delta_flush_leaf(DeltaCursor* cursor);
+Node* find_leaf_bounded(const char* key, KeyRef* upper, bool* bounded);
+UniversityNode* find_program(const RankList* list, const char* uni_name);
+bool delete_program(const char* dept_name, const char* uni_name);
+bool update_program_score(const char* dept_name, const char* uni_name, float score);
+bool apply_deletes(const char* filename);
+void remove_program(RankList* list, UniversityNode* uni);
+void remove_department(Node* leaf, int i);
+void rebalance_after_delete(Node* node);
+int child_index(const Node* parent, const Node* child);
+void borrow_from_left(Node* node, Node* left, int separator);
+void borrow_from_right(Node* node, Node* right, int separator);
+void merge_with_right(Node* left, Node* right, int separator);
+void remove_from_node(Node* node, int key_index, int pointer_index);
+void run_concurrency_benchmark(int max_threads, long queries, uint64_t seed);
+uint64_t bench_random(uint64_t* state);
+uint64_t monotonic_ns();
+bool generate_csv(const char* filename, long rows, uint64_t seed);
+int compare_u64(const void* a, const void* b);
+void print_latency(const char* label, uint64_t* samples, long count);
+void zipf_cdf(double* cdf, long n);
+long zipf_sample(const double* cdf, long n, uint64_t* state);
+void run_benchmark(long queries, uint64_t seed);
+void self_check(bool ok, const char* label, const char* what);
+void churn_plan(ChurnPlan* plan, RankList** lists, long departments, long records, uint64_t* state);
+void churn_plan_free(ChurnPlan* plan);
+bool run_self_test(uint64_t seed);
+bool csv_open(CsvReader* reader, const char* filename);
+void csv_close(CsvReader* reader);
+int csv_next_record(CsvReader* reader, CsvField* fields, int max_fields);
+size_t csv_field_copy(const CsvField* field, char* buf, size_t size);
+float parse_score(const char* s, size_t len);
+bool csv_read_record(CsvReader* reader, Record* record, int first_field);
 
 
-int main() {
+int main(int argc, char** argv) {
     int choice;
+    int order = DEFAULT_ORDER;
+    const char* save_index_path = NULL;
+    const char* open_index_path = NULL;
+    bool verify_index = false;
+    bool freeze = false;
+    bool benchmark = false;
+    bool concurrency_benchmark = false;
+    bool self_test = false;
+    int reader_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    const char* generate_path = NULL;
+    long generate_rows = 10000;
+    long benchmark_queries = 100000;
+    uint64_t seed = 42;
+    const char* batch_path = NULL;
+    int batch_size = DEFAULT_BATCH_SIZE;
+    int load_mode = 0;
+    const char* scan_from = NULL;
+    const char* scan_to = NULL;
+    const char* scan_prefix = NULL;
+    int scan_limit = 0;
+    const char* programs_uni = NULL;
+    const char* programs_dept = NULL;
+    const char* delta_path = NULL;
+    const char* delete_path = NULL;
+#ifdef INSTRUMENT
+    const char* report_path = NULL;
+#endif
+    bool score_query = false;
+    float min_score = -1e30f, max_score = 1e30f;
+    long top_programs = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "--order") == 0 || strcmp(argv[i], "-o") == 0) && i + 1 < argc) {
+            order = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--no-arena") == 0) {
+            use_arena = false;
+        } else if (strcmp(argv[i], "--no-key-prefixes") == 0) {
+            use_key_prefixes = false;
+        } else if (strcmp(argv[i], "--full-separators") == 0) {
+            truncate_separators = false;
+        } else if (strcmp(argv[i], "--no-hash-index") == 0) {
+            use_hash_index = false;
+        } else if (strcmp(argv[i], "--no-university-index") == 0) {
+            use_university_index = false;
+        } else if (strcmp(argv[i], "--no-score-index") == 0) {
+            use_score_index = false;
+        } else if (strcmp(argv[i], "--cache-size") == 0 && i + 1 < argc) {
+            long size = atol(argv[++i]);
+            if (size < 0) { fprintf(stderr, "Cache size must not be negative.\n"); return 1; }
+            rank_cache_size = (size_t)size;
+        } else if (strcmp(argv[i], "--score-range") == 0 && i + 2 < argc) {
+            min_score = (float)atof(argv[++i]);
+            max_score = (float)atof(argv[++i]);
+            score_query = true;
+        } else if (strcmp(argv[i], "--top-programs") == 0 && i + 1 < argc) {
+            top_programs = atol(argv[++i]);
+            if (top_programs < 1) { fprintf(stderr, "--top-programs must be positive.\n"); return 1; }
+            score_query = true;
+        } else if (strcmp(argv[i], "--university") == 0 && i + 1 < argc) {
+            programs_uni = argv[++i];
+        } else if (strcmp(argv[i], "--department") == 0 && i + 1 < argc) {
+            programs_dept = argv[++i];
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            sort_threads = atoi(argv[++i]);
+            if (sort_threads < 1) sort_threads = 1;
+        } else if (strcmp(argv[i], "--memory-budget") == 0 && i + 1 < argc) {
+            sort_memory_budget = parse_byte_size(argv[++i]);
+            if (sort_memory_budget == 0) { fprintf(stderr, "Invalid memory budget.\n"); return 1; }
+        } else if ((strcmp(argv[i], "--leaf-fill") == 0 || strcmp(argv[i], "--internal-fill") == 0) && i + 1 < argc) {
+            double fill = atof(argv[i + 1]);
+            if (fill <= 0 || fill > 1) { fprintf(stderr, "Fill factors must be in (0, 1].\n"); return 1; }
+            if (strcmp(argv[i], "--leaf-fill") == 0) leaf_fill_factor = fill;
+            else internal_fill_factor = fill;
+            i++;
+        } else if (strcmp(argv[i], "--report") == 0 && i + 1 < argc) {
+#ifdef INSTRUMENT
+            report_path = argv[++i];
+#else
+            fprintf(stderr, "--report needs a build with -DINSTRUMENT.\n");
+            return 1;
+#endif
+        } else if (strcmp(argv[i], "--delta") == 0 && i + 1 < argc) {
+            delta_path = argv[++i];
+        } else if (strcmp(argv[i], "--delete") == 0 && i + 1 < argc) {
+            delete_path = argv[++i];
+        } else if (strcmp(argv[i], "--save-index") == 0 && i + 1 < argc) {
+            save_index_path = argv[++i];
+        } else if (strcmp(argv[i], "--open-index") == 0 && i + 1 < argc) {
+            open_index_path = argv[++i];
+        } else if (strcmp(argv[i], "--freeze") == 0) {
+            freeze = true;
+        } else if (strcmp(argv[i], "--verify-index") == 0) {
+            verify_index = true;
+        } else if (strcmp(argv[i], "--input") == 0 && i + 1 < argc) {
+            input_file = argv[++i];
+        } else if (strcmp(argv[i], "--benchmark") == 0) {
+            benchmark = true;
+        } else if (strcmp(argv[i], "--self-test") == 0) {
+            self_test = true;
+        } else if (strcmp(argv[i], "--concurrency-benchmark") == 0) {
+            concurrency_benchmark = true;
+        } else if (strcmp(argv[i], "--reader-threads") == 0 && i + 1 < argc) {
+            reader_threads = atoi(argv[++i]);
+            if (reader_threads < 1) { fprintf(stderr, "Reader thread count must be positive.\n"); return 1; }
+        } else if (strcmp(argv[i], "--queries") == 0 && i + 1 < argc) {
+            benchmark_queries = atol(argv[++i]);
+            if (benchmark_queries < 1) { fprintf(stderr, "Query count must be positive.\n"); return 1; }
+        } else if (strcmp(argv[i], "--generate") == 0 && i + 1 < argc) {
+            generate_path = argv[++i];
+        } else if (strcmp(argv[i], "--rows") == 0 && i + 1 < argc) {
+            generate_rows = atol(argv[++i]);
+            if (generate_rows < 1) { fprintf(stderr, "Row count must be positive.\n"); return 1; }
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--load") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "sequential") == 0) load_mode = 1;
+            else if (strcmp(argv[i], "bulk") == 0) load_mode = 2;
+            else { fprintf(stderr, "--load takes 'sequential' or 'bulk'.\n"); return 1; }
+        } else if (strcmp(argv[i], "--range") == 0 && i + 2 < argc) {
+            scan_from = argv[++i];
+            scan_to = argv[++i];
+        } else if (strcmp(argv[i], "--prefix") == 0 && i + 1 < argc) {
+            scan_prefix = argv[++i];
+        } else if (strcmp(argv[i], "--top") == 0 && i + 1 < argc) {
+            scan_limit = atoi(argv[++i]);
+            if (scan_limit < 0) { fprintf(stderr, "--top must not be negative.\n"); return 1; }
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batch_path = argv[++i];
+        } else if (strcmp(argv[i], "--batch-size") == 0 && i + 1 < argc) {
+            batch_size = atoi(argv[++i]);
+            if (batch_size < 1) { fprintf(stderr, "Batch size must be positive.\n"); return 1; }
+        } else {
+            fprintf(stderr, "Usage: %s [--order N] [--no-arena] [--no-key-prefixes] [--full-separators] [--no-hash-index] [--no-university-index]\n"
+                            "          [--no-score-index] [--cache-size N] [--threads N] [--memory-budget BYTES[K|M|G]] [--leaf-fill F] [--internal-fill F]\n"
+                            "          [--save-index FILE | --open-index FILE [--verify-index]] [--input FILE] [--delta FILE] [--delete FILE]\n"
+                            "          [--freeze] [--generate FILE [--rows N]] [--benchmark [--queries N]] [--self-test] [--seed N]\n"
+                            "          [--concurrency-benchmark [--reader-threads N] [--queries N]]\n"
+                            "          [--load sequential|bulk] [--batch FILE|- [--batch-size N]]\n"
+                            "          [--range FROM TO | --prefix TEXT] [--top K] [--university NAME [--department NAME]]\n"
+                            "          [--score-range MIN MAX] [--top-programs N] [--report FILE.json|FILE.csv]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (!set_tree_order(order)) {
+        fprintf(stderr, "Tree order must be between %d and %d.\n", MIN_ORDER, MAX_ORDER);
+        return 1;
+    }
+
+    if (generate_path != NULL) {
+        double start = wall_clock_seconds();
+        if (!generate_csv(generate_path, generate_rows, seed)) return 1;
+        printf("Generated %ld rows in '%s' in %.4f sec.\n", generate_rows, generate_path, wall_clock_seconds() - start);
+        if (!benchmark && !concurrency_benchmark && !self_test) return 0;
+        input_file = generate_path;
+    }
+    if (self_test) {
+        bool passed = run_self_test(seed);
+        free_tree(root);
+        free_key_store();
+        return passed ? 0 : 1;
+    }
+    if (benchmark) {
+        run_benchmark(benchmark_queries, seed);
+        free_tree(root);
+        free_key_store();
+        return 0;
+    }
+    if (concurrency_benchmark) {
+        run_concurrency_benchmark(reader_threads, benchmark_queries, seed);
+        free_tree(root);
+        free_key_store();
+        return 0;
+    }
 
-    printf("Please choose a loading option:\n");
-    printf("1 - Sequential Insertion\n");
-    printf("2 - Bulk Loading (with external merge sort)\n>> ");
-    scanf("%d", &choice);
+    bool scan = scan_from != NULL || scan_prefix != NULL || programs_uni != NULL || score_query;
+    if (scan && (open_index_path != NULL || freeze)) {
+        fprintf(stderr, "Scans run on the mutable in-memory tree; use --load without --open-index or --freeze.\n");
+        return 1;
+    }
+    if (freeze && open_index_path != NULL) {
+        fprintf(stderr, "--freeze compacts a loaded tree; the index file is already read-only.\n");
+        return 1;
+    }
+    if (programs_uni != NULL && !use_university_index) {
+        fprintf(stderr, "--university needs the university index.\n");
+        return 1;
+    }
+    if ((delta_path != NULL || delete_path != NULL) && open_index_path != NULL) {
+        fprintf(stderr, "--delta and --delete change an in-memory tree; use --load instead of --open-index.\n");
+        return 1;
+    }
+    if (score_query && !use_score_index) {
+        fprintf(stderr, "--score-range and --top-programs need the score index.\n");
+        return 1;
+    }
+    //Batch and scan output own stdout, so progress messages go to stderr
+    FILE* status = batch_path != NULL || scan ? stderr : stdout;
+    if (open_index_path != NULL) {
+        double start = wall_clock_seconds();
+        if (!paged_index_open(&paged_index, open_index_path, verify_index)) return 1;
+        set_tree_order((int)paged_index.header->order);
+        fprintf(status, "Opened index '%s' in %.6f sec.\n", open_index_path, wall_clock_seconds() - start);
+        choice = 0;
+    } else if (load_mode != 0) {
+        choice = load_mode;
+    } else {
+        printf("Please choose a loading option:\n");
+        printf("1 - Sequential Insertion\n");
+        printf("2 - Bulk Loading (with external merge sort)\n>> ");
+        scanf("%d", &choice);
+    }
 
-    if (choice == 1) {
-        printf("Running Sequential Insertion...\n");
+#ifdef INSTRUMENT
+    if (report_path != NULL) instrument_begin();
+#endif
+    if (open_index_path != NULL) {
+        //Queries are answered from the mapped file
+    } else if (choice == 1) {
+        fprintf(status, "Running Sequential Insertion...\n");
         run_sequential_insertion();
-        printf("Sequantial insertion completed.\n");
+        fprintf(status, "Sequantial insertion completed.\n");
     } else if (choice == 2) {
-        printf("Running Bulk Loading...\n");
-        run_bulk_loading();
-        printf("Bulk loading completed.\n");
+        fprintf(status, "Running Bulk Loading...\n");
+        if (!run_bulk_loading()) return 1;
+        fprintf(status, "Bulk loading completed.\n");
     } else {
         printf("Invalid choice.\n");
         return 1;
     }
+    if (delta_path != NULL) {
+        if (!apply_delta(delta_path)) return 1;
+        fprintf(status, "Delta '%s' merged: %ld rows, %ld inserted, %ld updated, %ld new departments, %ld leaves touched, %ld leaves added in %.4f sec.\n",
+                delta_path, delta_stats.rows, delta_stats.inserted, delta_stats.updated, delta_stats.new_departments,
+                delta_stats.leaves_touched, delta_stats.leaves_added, delta_stats.seconds);
+    }
+    if (delete_path != NULL) {
+        if (!apply_deletes(delete_path)) return 1;
+        fprintf(status, "Deletes '%s' applied: %ld rows, %ld programs and %ld departments removed in %.4f sec.\n",
+                delete_path, delete_stats.rows, delete_stats.deleted, delete_stats.departments_removed, delete_stats.seconds);
+    }
+    if (save_index_path != NULL) {
+        if (!save_index(save_index_path)) return 1;
+        fprintf(status, "Index saved to '%s'.\n", save_index_path);
+    }
+    if (freeze) {
+        double mutable_memory = calculate_memory_usage();
+        double start = wall_clock_seconds();
+        if (!freeze_tree(&frozen_tree)) return 1;
+        double seconds = wall_clock_seconds() - start;
+        //Queries now run on the snapshot, so the mutable tree can go
+        free_tree(root);
+        free_key_store();
+        root = NULL;
+        first_leaf = NULL;
+        fprintf(status, "Tree frozen in %.4f sec: %.4f MB mutable, %.4f MB frozen.\n", seconds, mutable_memory, calculate_memory_usage());
+    }
+#ifdef INSTRUMENT
+    //Everything after this point is reported as the query phase
+    const char* load_name = open_index_path != NULL ? "index" : choice == 1 ? "sequential" : "bulk";
+    if (report_path != NULL) instrument_snapshot(&instrument_load);
+#endif
+    if (scan) {
+        ScanIterator it;
+        if (programs_uni != NULL) {
+            print_university_programs(programs_uni, programs_dept, stdout);
+        } else if (score_query) {
+            print_score_range(min_score, max_score, top_programs, stdout);
+        } else {
+            if (scan_prefix != NULL) scan_begin_prefix(&it, scan_prefix, scan_limit);
+            else scan_begin_range(&it, scan_from, scan_to, scan_limit);
+            print_scan(&it, stdout);
+        }
+#ifdef INSTRUMENT
+        if (report_path != NULL && !write_report(report_path, load_name)) return 1;
+#endif
+        free_tree(root);
+        free_key_store();
+        return 0;
+    }
+    if (batch_path != NULL) {
+        FILE* in = strcmp(batch_path, "-") == 0 ? stdin : fopen(batch_path, "r");
+        if (in == NULL) { perror("Could not open batch file"); return 1; }
+        run_batch_queries(in, stdout, batch_size);
+        if (in != stdin) fclose(in);
+#ifdef INSTRUMENT
+        if (report_path != NULL && !write_report(report_path, load_name)) return 1;
+#endif
+        free_tree(root);
+        free_key_store();
+        paged_index_close(&paged_index);
+        frozen_tree_free(&frozen_tree);
+        return 0;
+    }
 
-    int height = calculate_tree_height();
-    double memory_usage = calculate_memory_usage();
-    double time_taken = calculate_average_seek_time("yok_atlas.csv");
+    double time_taken = calculate_average_seek_time(input_file);
     //printf("Total records: %d\n",total_record);
     
     choice = 0;
-    while(choice != 3) {
+    while(choice != 5) {
         printf("Please choose an action:\n");
         printf("1 - Print Metrics\n");
         printf("2 - Search\n");
-        printf("3 - Exit\n>> ");
+        printf("3 - Delete Program\n");
+        printf("4 - Update Score\n");
+        printf("5 - Exit\n>> ");
         scanf("%d", &choice);
 
         if(choice == 1) {
+            printf("Tree order (fanout): %d\n", tree_order);
+            printf("Node size: %zu bytes\n", node_size);
+            printf("Number of nodes: %lld\n", paged_index.base ? (long long)paged_index.header->node_pages
+                                             : frozen_tree.nodes ? (long long)frozen_tree.node_count : node_allocations);
             printf("Number of splits: %lld\n", split_count);
-            printf("Memory usage: %.4f MB\n", memory_usage);
-            printf("Tree height: %d\n", height);
+            printf("Number of merges: %lld, borrows: %lld\n", merge_count, borrow_count);
+            printf("Memory usage: %.4f MB\n", calculate_memory_usage());
+            printf("Tree height: %d\n", calculate_tree_height());
+            if (root != NULL) {
+                KeyStats stats = {0, 0, 0, 0};
+                calculate_key_stats(root, &stats);
+                printf("Key bytes: %zu inline, %zu prefix-compressed (%.1f%% saved)\n", stats.inline_bytes,
+                       stats.compressed_bytes, 100.0 * (1.0 - (double)stats.compressed_bytes / stats.inline_bytes));
+                if (stats.separator_full_bytes > 0) {
+                    printf("Separator bytes: %zu full, %zu truncated (%.1f%% saved)\n", stats.separator_full_bytes,
+                           stats.separator_bytes, 100.0 * (1.0 - (double)stats.separator_bytes / stats.separator_full_bytes));
+                }
+            }
+            if (run_generation_threads > 0) {
+                printf("Run generation: %.4f sec (%d threads)\n", run_generation_seconds, run_generation_threads);
+                printf("Sort memory budget: %zu bytes, merge passes: %d\n", sort_memory_budget, merge_passes);
+                printf("Merge and build: %.4f sec (%d threads)\n", merge_build_seconds, build_threads);
+            }
+            if (delta_stats.rows > 0) {
+                printf("Delta merge: %ld rows (%ld inserted, %ld updated, %ld unchanged) in %.4f sec\n", delta_stats.rows,
+                       delta_stats.inserted, delta_stats.updated, delta_stats.unchanged, delta_stats.seconds);
+            }
+            if (delete_stats.rows > 0) {
+                printf("Deletes: %ld rows, %ld programs and %ld departments removed in %.4f sec\n", delete_stats.rows,
+                       delete_stats.deleted, delete_stats.departments_removed, delete_stats.seconds);
+            }
+            if (rank_cache_size > 0 && !readonly_layout()) {
+                long long lookups = rank_cache.hits + rank_cache.misses;
+                printf("Rank cache: %zu entries, %lld hits, %lld misses (%.1f%% hit rate), %lld evictions, %lld invalidations\n",
+                       rank_cache.entries ? rank_cache.set_count * RANK_CACHE_WAYS : rank_cache_size, rank_cache.hits, rank_cache.misses,
+                       lookups > 0 ? 100.0 * rank_cache.hits / lookups : 0.0, rank_cache.evictions, rank_cache.invalidations);
+            }
             printf("Average seek time: %.8f sec\n\n", time_taken);
         }
         else if(choice == 2) {
@@ -128,132 +1191,719 @@ int main() {
 
             search_department_by_rank(dept_name, rank);
         }
+        else if(choice == 3 || choice == 4) {
+            char dept_name[MAX_LINE_LEN];
+            char uni_name[MAX_LINE_LEN];
+            float score = 0;
+
+            getchar();
+
+            printf("Please enter the department name:\n>> ");
+            fgets(dept_name, sizeof(dept_name), stdin);
+            dept_name[strcspn(dept_name, "\n")] = 0;
+
+            printf("Please enter the university name:\n>> ");
+            fgets(uni_name, sizeof(uni_name), stdin);
+            uni_name[strcspn(uni_name, "\n")] = 0;
+
+            if (choice == 4) {
+                printf("Please enter the new base placement score:\n>> ");
+                scanf("%f", &score);
+            }
+
+            if (readonly_layout()) {
+                printf("The loaded index is read-only.\n\n");
+            } else if (choice == 3 ? delete_program(dept_name, uni_name) : update_program_score(dept_name, uni_name, score)) {
+                printf(choice == 3 ? "Program deleted.\n\n" : "Score updated.\n\n");
+            } else {
+                printf("'%s' not found in department '%s'.\n\n", uni_name, dept_name);
+            }
+        }
 
     }
     
+#ifdef INSTRUMENT
+    if (report_path != NULL && write_report(report_path, load_name)) printf("Report written to '%s'.\n", report_path);
+#endif
     free_tree(root);
+    free_key_store();
+    paged_index_close(&paged_index);
+    frozen_tree_free(&frozen_tree);
     printf("\nMemory cleaned. Program terminated.\n");
     return 0;
 }
 
 
+//CSV Functions
+
+bool csv_open(CsvReader* reader, const char* filename) {
+    memset(reader, 0, sizeof(CsvReader));
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0) { close(fd); return false; }
+    reader->size = (size_t)st.st_size;
+    reader->end = reader->size;
+    if (reader->size == 0) { close(fd); return true; }
+    void* data = mmap(NULL, reader->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+        madvise(data, reader->size, MADV_SEQUENTIAL);
+        reader->data = (const char*)data;
+        reader->mapped = true;
+    } else {
+        //Not mappable (e.g. a pipe): fall back to reading the whole file once
+        char* buffer = (char*)malloc(reader->size);
+        if (!buffer || read(fd, buffer, reader->size) != (ssize_t)reader->size) {
+            free(buffer); close(fd); return false;
+        }
+        reader->data = buffer;
+    }
+    close(fd);
+    return true;
+}
+
+void csv_close(CsvReader* reader) {
+    if (reader->mapped) munmap((void*)reader->data, reader->size);
+    else free((void*)reader->data);
+    reader->data = NULL;
+}
+
+//Splits the next record into fields that point into the file. Returns the
+//number of fields, or -1 when the input is exhausted.
+int csv_next_record(CsvReader* reader, CsvField* fields, int max_fields) {
+    const char* p = reader->data + reader->pos;
+    const char* end = reader->data + reader->end;
+    if (p >= end) return -1;
+    int count = 0;
+    while (true) {
+        CsvField field = {p, 0, false};
+        if (p < end && *p == '"') {
+            field.start = ++p;
+            while (p < end) {
+                if (*p == '"') {
+                    if (p + 1 < end && p[1] == '"') { field.escaped = true; p += 2; continue; }
+                    break;
+                }
+                p++;
+            }
+            field.len = (size_t)(p - field.start);
+            if (p < end) p++;
+            while (p < end && *p != ',' && *p != '\n') p++;
+        } else {
+            while (p < end && *p != ',' && *p != '\n') p++;
+            field.len = (size_t)(p - field.start);
+            if (field.len > 0 && field.start[field.len - 1] == '\r') field.len--;
+        }
+        if (count < max_fields) fields[count] = field;
+        count++;
+        if (p < end && *p == ',') { p++; continue; }
+        if (p < end) p++;
+        break;
+    }
+    reader->pos = (size_t)(p - reader->data);
+    return count;
+}
+
+//Copies a field into buf as a C string, undoing "" escapes and truncating to size - 1
+size_t csv_field_copy(const CsvField* field, char* buf, size_t size) {
+    size_t n = 0;
+    if (!field->escaped) {
+        n = field->len < size - 1 ? field->len : size - 1;
+        memcpy(buf, field->start, n);
+    } else {
+        for (size_t i = 0; i < field->len && n < size - 1; i++) {
+            buf[n++] = field->start[i];
+            if (field->start[i] == '"') i++;
+        }
+    }
+    buf[n] = '\0';
+    return n;
+}
+
+//Decimal parser for scores: [sign] digits [. digits] [e exponent]
+float parse_score(const char* s, size_t len) {
+    static const double powers_of_ten[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    const char* p = s;
+    const char* end = s + len;
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) negative = (*p++ == '-');
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; p++) {
+        if (digits < 19) { mantissa = mantissa * 10 + (uint64_t)(*p - '0'); if (mantissa) digits++; }
+        else exponent++;
+    }
+    if (p < end && *p == '.') {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++) {
+            if (digits < 19) { mantissa = mantissa * 10 + (uint64_t)(*p - '0'); if (mantissa) digits++; exponent--; }
+        }
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        bool exp_negative = false;
+        if (p < end && (*p == '-' || *p == '+')) exp_negative = (*p++ == '-');
+        int e = 0;
+        for (; p < end && *p >= '0' && *p <= '9'; p++) if (e < 10000) e = e * 10 + (*p - '0');
+        exponent += exp_negative ? -e : e;
+    }
+    double value = (double)mantissa;
+    if (exponent < 0) {
+        while (exponent < -22) { value /= 1e22; exponent += 22; }
+        value /= powers_of_ten[-exponent];
+    } else {
+        while (exponent > 22) { value *= 1e22; exponent -= 22; }
+        value *= powers_of_ten[exponent];
+    }
+    return (float)(negative ? -value : value);
+}
+
+//Reads the next (university, department, score) record starting at field
+//first_field, skipping malformed rows. Returns false at end of input.
+bool csv_read_record(CsvReader* reader, Record* record, int first_field) {
+    CsvField fields[CSV_MAX_FIELDS];
+    int count;
+    while (true) {
+        record->position = reader->pos;
+        if ((count = csv_next_record(reader, fields, CSV_MAX_FIELDS)) < 0) break;
+        if (count < first_field + 3) continue;
+        csv_field_copy(&fields[first_field], record->uni_name, MAX_LINE_LEN);
+        csv_field_copy(&fields[first_field + 1], record->dept_name, MAX_LINE_LEN);
+        if (record->uni_name[0] == '\0' || record->dept_name[0] == '\0') continue;
+        record->score = parse_score(fields[first_field + 2].start, fields[first_field + 2].len);
+        return true;
+    }
+    return false;
+}
+
 //B+Tree Functions
 
+bool set_tree_order(int order) {
+    if (order < MIN_ORDER || order > MAX_ORDER) return false;
+    tree_order = order;
+    //Header, then tree_order key prefixes, tree_order + 1 pointers and tree_order key handles
+    size_t bytes = sizeof(Node) + (size_t)order * sizeof(uint64_t) + (size_t)(order + 1) * sizeof(void*) +
+                   (size_t)order * sizeof(KeyRef);
+    node_size = (bytes + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+    return true;
+}
+
+KeyRef key_store_add(const char* key) {
+    return key_store_append(&key_store, key, strlen(key) + 1);
+}
+
+//Copies len bytes (one or more NUL-terminated keys) to the end of store
+KeyRef key_store_append(KeyStore* store, const char* key, size_t len) {
+    //KeyRefs are 32-bit offsets, so the store must stay addressable by them
+    if (store->used > UINT32_MAX || len > UINT32_MAX - store->used) { fprintf(stderr, "Key store exceeds 4 GiB\n"); exit(1); }
+    key_store_reserve(store, len);
+    KeyRef ref = (KeyRef)store->used;
+    memcpy(store->data + store->used, key, len);
+    store->used += len;
+    return ref;
+}
+
+void key_store_reserve(KeyStore* store, size_t extra) {
+    if (store->used + extra <= store->capacity) return;
+    size_t new_capacity = store->capacity ? store->capacity * 2 : 4096;
+    while (new_capacity < store->used + extra) new_capacity *= 2;
+    char* data = (char*)realloc(store->data, new_capacity);
+    if (!data) { perror("Key store allocation failed"); exit(1); }
+    store->data = data;
+    store->capacity = new_capacity;
+}
+
+const char* key_str(KeyRef ref) {
+    return key_store.data + ref;
+}
+
+void free_key_store() {
+    free(key_store.data);
+    key_store.data = NULL;
+    key_store.used = 0;
+    key_store.capacity = 0;
+    dept_hash_free(); //The secondary indexes go with the data they refer to
+    uni_index_free();
+    score_index_free();
+    rank_cache_free();
+}
+
+//FNV-1a
+uint32_t hash_key(const char* key) {
+    uint32_t hash = 2166136261u;
+    for (const char* p = key; *p; p++) hash = (hash ^ (uint8_t)*p) * 16777619u;
+    return hash;
+}
+
+RankList* dept_hash_find(const char* dept_name) {
+    if (dept_hash.count == 0) return NULL;
+    uint32_t hash = hash_key(dept_name);
+    size_t mask = dept_hash.capacity - 1;
+    for (size_t i = hash & mask; dept_hash.slots[i].list != NULL; i = (i + 1) & mask) {
+        if (dept_hash.slots[i].hash == hash && strcmp(key_str(dept_hash.slots[i].key), dept_name) == 0) {
+            return dept_hash.slots[i].list;
+        }
+    }
+    return NULL;
+}
+
+//Adds a department that is not in the map yet, doubling the table past a 0.7 load factor
+void dept_hash_insert(KeyRef key, RankList* list) {
+    if (!use_hash_index) return;
+    if ((dept_hash.count + 1) * 10 > dept_hash.capacity * 7) {
+        size_t new_capacity = dept_hash.capacity ? dept_hash.capacity * 2 : 1024;
+        DeptHashSlot* slots = (DeptHashSlot*)calloc(new_capacity, sizeof(DeptHashSlot));
+        if (!slots) { perror("Hash index allocation failed"); exit(1); }
+        for (size_t i = 0; i < dept_hash.capacity; i++) {
+            if (dept_hash.slots[i].list == NULL) continue;
+            size_t j = dept_hash.slots[i].hash & (new_capacity - 1);
+            while (slots[j].list != NULL) j = (j + 1) & (new_capacity - 1);
+            slots[j] = dept_hash.slots[i];
+        }
+        free(dept_hash.slots);
+        dept_hash.slots = slots;
+        dept_hash.capacity = new_capacity;
+    }
+    uint32_t hash = hash_key(key_str(key));
+    size_t mask = dept_hash.capacity - 1;
+    size_t i = hash & mask;
+    while (dept_hash.slots[i].list != NULL) i = (i + 1) & mask;
+    dept_hash.slots[i].hash = hash;
+    dept_hash.slots[i].key = key;
+    dept_hash.slots[i].list = list;
+    dept_hash.count++;
+}
+
+//Backward-shift deletion: later entries of the probe run move into the hole
+//unless their home slot lies after it, so lookups need no tombstones
+void dept_hash_remove(const char* dept_name) {
+    if (dept_hash.count == 0) return;
+    uint32_t hash = hash_key(dept_name);
+    size_t mask = dept_hash.capacity - 1;
+    size_t i = hash & mask;
+    while (dept_hash.slots[i].list != NULL &&
+           (dept_hash.slots[i].hash != hash || strcmp(key_str(dept_hash.slots[i].key), dept_name) != 0)) i = (i + 1) & mask;
+    if (dept_hash.slots[i].list == NULL) return;
+    for (size_t j = (i + 1) & mask; dept_hash.slots[j].list != NULL; j = (j + 1) & mask) {
+        size_t home = dept_hash.slots[j].hash & mask;
+        bool movable = j > i ? home <= i || home > j : home <= i && home > j;
+        if (movable) {
+            dept_hash.slots[i] = dept_hash.slots[j];
+            i = j;
+        }
+    }
+    dept_hash.slots[i].list = NULL;
+    dept_hash.count--;
+}
+
+void dept_hash_free() {
+    free(dept_hash.slots);
+    dept_hash.slots = NULL;
+    dept_hash.capacity = 0;
+    dept_hash.count = 0;
+}
+
+//First 8 bytes of a key as a big-endian integer, zero padded. Comparing two
+//prefixes orders keys like strcmp unless the prefixes are equal.
+uint64_t key_prefix(const char* key) {
+    uint64_t prefix = 0;
+    int i = 0;
+    for (; i < 8 && key[i] != '\0'; i++) prefix = (prefix << 8) | (uint8_t)key[i];
+    //An empty key is all padding; shifting by 64 would be undefined
+    if (i == 0) return 0;
+    return i == 8 ? prefix : prefix << (8 * (8 - i));
+}
+
+//Number of prefixes[0..n) that are < prefix (or <= prefix when inclusive),
+//counted without branches; with AVX2 four prefixes are compared per instruction
+//(unsigned order via the sign-bit flip)
+int count_prefixes_below(const uint64_t* prefixes, int n, uint64_t prefix, bool inclusive) {
+    int i = 0, count = 0;
+#ifdef __AVX2__
+    const __m256i flip = _mm256_set1_epi64x((long long)0x8000000000000000ull);
+    const __m256i target = _mm256_xor_si256(_mm256_set1_epi64x((long long)prefix), flip);
+    for (; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(prefixes + i)), flip);
+        int mask = inclusive ? 15 ^ _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(v, target)))
+                             : _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(target, v)));
+        count += __builtin_popcount(mask);
+    }
+#endif
+    if (inclusive) for (; i < n; i++) count += prefixes[i] <= prefix;
+    else for (; i < n; i++) count += prefixes[i] < prefix;
+    return count;
+}
+
+//Keys [0, first) have a smaller prefix and keys [first, last) the same prefix.
+//first comes from a branch-free binary search over the sorted prefix array (the
+//comparison feeds a conditional move) down to PREFIX_SCAN_WIDTH entries, which
+//count_prefixes_below finishes. Equal prefixes are usually few, so last is found
+//by stepping forward, with a second search for long runs of ties.
+void node_prefix_range(const Node* node, uint64_t prefix, int* first, int* last) {
+    const uint64_t* prefixes = node->prefixes;
+    int n = node->num_keys;
+    int base = 0, len = n;
+    while (len > PREFIX_SCAN_WIDTH) {
+        int half = len / 2;
+        base += prefixes[base + half - 1] < prefix ? half : 0;
+        len -= half;
+    }
+    int lo = base + count_prefixes_below(prefixes + base, len, prefix, false);
+    int hi = lo;
+    while (hi < n && hi - lo < PREFIX_SCAN_WIDTH && prefixes[hi] == prefix) hi++;
+    if (hi - lo == PREFIX_SCAN_WIDTH) {
+        base = hi;
+        len = n - hi;
+        while (len > PREFIX_SCAN_WIDTH) {
+            int half = len / 2;
+            base += prefixes[base + half - 1] <= prefix ? half : 0;
+            len -= half;
+        }
+        hi = base + count_prefixes_below(prefixes + base, len, prefix, true);
+    }
+    *first = lo;
+    *last = hi;
+}
+
+//Stores key at slot i. Its fingerprint assumes the key shares the node's prefix;
+//callers run node_refresh_prefixes afterwards in case it does not.
+void node_set_key(Node* node, int i, KeyRef key) {
+    const char* str = key_str(key);
+    node->keys[i] = key;
+    node->prefixes[i] = strnlen(str, node->prefix_len) == (size_t)node->prefix_len ? key_prefix(str + node->prefix_len) : 0;
+}
+
+//Recomputes the node's shared prefix and, when it changed, every fingerprint.
+//Keys are sorted, so the prefix shared by all of them is that of the first and last.
+void node_refresh_prefixes(Node* node) {
+    int len = 0;
+    if (node->num_keys > 0) {
+        const char* first = key_str(node->keys[0]);
+        const char* last = key_str(node->keys[node->num_keys - 1]);
+        while (first[len] != '\0' && first[len] == last[len]) len++;
+    }
+    if (len == node->prefix_len) return;
+    node->prefix_len = len;
+    for (int i = 0; i < node->num_keys; i++) node->prefixes[i] = key_prefix(key_str(node->keys[i]) + len);
+}
+
+//Shortest separator s with left_max < s <= right_min: right_min cut one byte past
+//the common prefix. Falls back to right_min itself when that is no shorter.
+KeyRef separator_between(KeyRef left_max, KeyRef right_min) {
+    const char* left = key_str(left_max);
+    const char* right = key_str(right_min);
+    size_t len = 0;
+    while (left[len] != '\0' && left[len] == right[len]) len++;
+    if (!truncate_separators || right[len] == '\0' || right[len + 1] == '\0') return right_min;
+    char separator[MAX_LINE_LEN];
+    memcpy(separator, right, len + 1);
+    separator[len + 1] = '\0';
+    return key_store_add(separator);
+}
+
+//Index of the first key that is >= key
+int node_lower_bound(const Node* node, const char* key) {
+    return node_lower_bound_with(node, key, use_key_prefixes);
+}
+
+//node_lower_bound with the key prefixes used or not as the caller says
+int node_lower_bound_with(const Node* node, const char* key, bool prefixes) {
+    int lo = 0, hi = node->num_keys, skip = 0;
+    if (prefixes && hi > 0) {
+        //Keys outside the node's shared prefix sort before or after every key.
+        //Otherwise only keys with the same fingerprint need a full comparison, and
+        //only past the fingerprinted bytes; a fingerprint ending in NUL covers the key.
+        int shared = node->prefix_len;
+        int cmp = strncmp(key, key_str(node->keys[0]), shared);
+        COUNT(key_comparisons, 1);
+        if (cmp != 0) return cmp < 0 ? 0 : hi;
+        uint64_t prefix = key_prefix(key + shared);
+        node_prefix_range(node, prefix, &lo, &hi);
+        COUNT(prefix_searches, 1);
+        if ((prefix & 0xFF) == 0) return lo;
+        skip = shared + 8;
+    }
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        COUNT(key_comparisons, 1);
+        if (strcmp(key_str(node->keys[mid]) + skip, key + skip) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+//Number of keys that are <= key, i.e. the child to descend into
+int node_upper_bound(const Node* node, const char* key) {
+    return node_upper_bound_with(node, key, use_key_prefixes);
+}
+
+int node_upper_bound_with(const Node* node, const char* key, bool prefixes) {
+    int lo = 0, hi = node->num_keys, skip = 0;
+    if (prefixes && hi > 0) {
+        int shared = node->prefix_len;
+        int cmp = strncmp(key, key_str(node->keys[0]), shared);
+        COUNT(key_comparisons, 1);
+        if (cmp != 0) return cmp < 0 ? 0 : hi;
+        uint64_t prefix = key_prefix(key + shared);
+        node_prefix_range(node, prefix, &lo, &hi);
+        COUNT(prefix_searches, 1);
+        if ((prefix & 0xFF) == 0) return hi;
+        skip = shared + 8;
+    }
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        COUNT(key_comparisons, 1);
+        if (strcmp(key_str(node->keys[mid]) + skip, key + skip) <= 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+void* arena_alloc(Arena* arena, size_t size, size_t align) {
+    ArenaChunk* chunk = arena->head;
+    size_t offset = 0;
+    if (chunk) offset = (chunk->used + align - 1) / align * align;
+    if (!chunk || offset + size > chunk->size) {
+        //Chunks double up to ARENA_MAX_CHUNK. Data starts one cache line in, so any
+        //align up to CACHE_LINE_SIZE holds.
+        size_t chunk_size = chunk ? chunk->size * 2 : ARENA_MIN_CHUNK;
+        if (chunk_size > ARENA_MAX_CHUNK) chunk_size = ARENA_MAX_CHUNK;
+        if (size + CACHE_LINE_SIZE > chunk_size) chunk_size = (size + 2 * CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+        chunk = (ArenaChunk*)aligned_alloc(CACHE_LINE_SIZE, chunk_size);
+        if (!chunk) return NULL;
+        chunk->next = arena->head;
+        chunk->size = chunk_size;
+        arena->head = chunk;
+        arena->reserved += chunk_size;
+        offset = CACHE_LINE_SIZE;
+    }
+    chunk->used = offset + size;
+    return (char*)chunk + offset;
+}
+
+void arena_release(Arena* arena) {
+    ArenaChunk* chunk = arena->head;
+    while (chunk != NULL) {
+        ArenaChunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->head = NULL;
+    arena->reserved = 0;
+}
+
+//Hands every chunk of from over to into; from's blocks stay where they are
+void arena_splice(Arena* into, Arena* from) {
+    if (from->head == NULL) return;
+    ArenaChunk* tail = from->head;
+    while (tail->next != NULL) tail = tail->next;
+    tail->next = into->head;
+    into->head = from->head;
+    into->reserved += from->reserved;
+    from->head = NULL;
+    from->reserved = 0;
+}
+
 Node* create_node(bool is_leaf) {
     node_allocations++;
-    Node* new_node = (Node*)calloc(1, sizeof(Node));
+    return create_node_in(&node_arena, is_leaf);
+}
+
+//Allocates from arena without counting the node; parallel builders pass their own arena
+Node* create_node_in(Arena* arena, bool is_leaf) {
+    Node* new_node = use_arena ? (Node*)arena_alloc(arena, node_size, CACHE_LINE_SIZE)
+                               : (Node*)aligned_alloc(CACHE_LINE_SIZE, node_size);
     if (!new_node) { perror("Node allocation failed"); exit(1); }
+    memset(new_node, 0, node_size);
+    new_node->prefixes = (uint64_t*)(new_node + 1);
+    new_node->pointers = (void**)(new_node->prefixes + tree_order);
+    new_node->keys = (KeyRef*)(new_node->pointers + tree_order + 1);
     new_node->is_leaf = is_leaf;
     return new_node;
 }
 
+//Arena blocks are only reclaimed with the whole arena; the counts still drop
+void free_node(Node* node) {
+    node_allocations--;
+    if (!use_arena) free(node);
+}
+
 UniversityNode* create_university(const char* name, float score) {
+    return create_university_node(name, score, random_skip_level());
+}
+
+UniversityNode* create_university_node(const char* name, float score, int level) {
     uni_node_allocations++;
-    UniversityNode* new_uni = (UniversityNode*)malloc(sizeof(UniversityNode));
+    uni_node_bytes += sizeof(UniversityNode) + (size_t)level * sizeof(SkipLink);
+    return create_university_in(&uni_arena, name, score, level);
+}
+
+UniversityNode* create_university_in(Arena* arena, const char* name, float score, int level) {
+    size_t bytes = sizeof(UniversityNode) + (size_t)level * sizeof(SkipLink);
+    UniversityNode* new_uni = use_arena ? (UniversityNode*)arena_alloc(arena, bytes, sizeof(void*))
+                                        : (UniversityNode*)malloc(bytes);
     if (!new_uni) { perror("UniversityNode allocation failed"); exit(1); }
     strncpy(new_uni->university_name, name, MAX_LINE_LEN - 1);
     new_uni->university_name[MAX_LINE_LEN - 1] = '\0';
     new_uni->score = score;
-    new_uni->next = NULL;
+    new_uni->level = level;
+    memset(new_uni->links, 0, (size_t)level * sizeof(SkipLink));
     return new_uni;
 }
 
-void insert_into_parent(Node* old_node, const char* key, Node* new_node);
+void free_university(UniversityNode* uni) {
+    uni_node_allocations--;
+    uni_node_bytes -= sizeof(UniversityNode) + (size_t)uni->level * sizeof(SkipLink);
+    if (!use_arena) free(uni);
+}
+
+RankList* create_rank_list() {
+    rank_list_allocations++;
+    return create_rank_list_in(&uni_arena);
+}
+
+RankList* create_rank_list_in(Arena* arena) {
+    RankList* list = use_arena ? (RankList*)arena_alloc(arena, sizeof(RankList), sizeof(void*))
+                               : (RankList*)malloc(sizeof(RankList));
+    if (!list) { perror("RankList allocation failed"); exit(1); }
+    memset(list, 0, sizeof(RankList));
+    list->level = 1;
+    return list;
+}
+
+void insert_into_parent(Node* old_node, KeyRef key, Node* new_node);
 
 void insert_into_leaf(Node* leaf, const char* dept_name, const char* uni_name, float score) {
-    int i = 0;
-    while (i < leaf->num_keys && strcmp(leaf->keys[i], dept_name) != 0) i++;
-    if (i < leaf->num_keys) {
-        insert_into_sorted_list((UniversityNode**)&leaf->pointers[i], create_university(uni_name, score));
+    int insertion_point = node_lower_bound(leaf, dept_name);
+    if (insertion_point < leaf->num_keys && strcmp(key_str(leaf->keys[insertion_point]), dept_name) == 0) {
+        UniversityNode* new_uni = create_university(uni_name, score);
+        insert_into_sorted_list((RankList*)leaf->pointers[insertion_point], new_uni);
+        uni_index_add(new_uni, (RankList*)leaf->pointers[insertion_point]);
+        score_index_insert(new_uni, (RankList*)leaf->pointers[insertion_point]);
         return;
     }
-    int insertion_point = 0;
-    while (insertion_point < leaf->num_keys && strcmp(leaf->keys[insertion_point], dept_name) < 0) insertion_point++;
     for (int j = leaf->num_keys; j > insertion_point; j--) {
-        strcpy(leaf->keys[j], leaf->keys[j - 1]);
+        leaf->keys[j] = leaf->keys[j - 1];
+        leaf->prefixes[j] = leaf->prefixes[j - 1];
         leaf->pointers[j] = leaf->pointers[j - 1];
     }
-    strcpy(leaf->keys[insertion_point], dept_name);
-    UniversityNode* new_list_head = NULL;
-    insert_into_sorted_list(&new_list_head, create_university(uni_name, score));
-    leaf->pointers[insertion_point] = new_list_head;
+    node_set_key(leaf, insertion_point, key_store_add(dept_name));
+    RankList* new_list = create_rank_list();
+    new_list->key = leaf->keys[insertion_point];
+    dept_hash_insert(new_list->key, new_list);
+    UniversityNode* new_uni = create_university(uni_name, score);
+    insert_into_sorted_list(new_list, new_uni);
+    uni_index_add(new_uni, new_list);
+    score_index_insert(new_uni, new_list);
+    leaf->pointers[insertion_point] = new_list;
     leaf->num_keys++;
-    if (leaf->num_keys == ORDER - 1) {
+    node_refresh_prefixes(leaf);
+    if (leaf->num_keys == tree_order) {
         split_count++;
         Node* new_leaf = create_node(true);
         new_leaf->parent = leaf->parent;
-        int split_point = (ORDER - 1) / 2;
-        new_leaf->num_keys = (ORDER - 1) - split_point;
+        int split_point = tree_order / 2;
+        new_leaf->num_keys = tree_order - split_point;
+        new_leaf->prefix_len = leaf->prefix_len;
         leaf->num_keys = split_point;
         for (int j = 0; j < new_leaf->num_keys; j++) {
-            strcpy(new_leaf->keys[j], leaf->keys[j + split_point]);
+            new_leaf->keys[j] = leaf->keys[j + split_point];
+            new_leaf->prefixes[j] = leaf->prefixes[j + split_point];
             new_leaf->pointers[j] = leaf->pointers[j + split_point];
         }
         new_leaf->next = leaf->next;
         leaf->next = new_leaf;
-        insert_into_parent(leaf, new_leaf->keys[0], new_leaf);
+        node_refresh_prefixes(leaf);
+        node_refresh_prefixes(new_leaf);
+        insert_into_parent(leaf, separator_between(leaf->keys[leaf->num_keys - 1], new_leaf->keys[0]), new_leaf);
     }
 }
 
-void insert_into_parent(Node* old_node, const char* key, Node* new_node) {
+void insert_into_parent(Node* old_node, KeyRef key, Node* new_node) {
     if (old_node->parent == NULL) {
         root = create_node(false);
-        strcpy(root->keys[0], key);
+        node_set_key(root, 0, key);
         root->pointers[0] = old_node;
         root->pointers[1] = new_node;
         root->num_keys = 1;
+        node_refresh_prefixes(root);
         old_node->parent = root;
         new_node->parent = root;
         return;
     }
     Node* parent = old_node->parent;
-    int i = 0;
-    while (i < parent->num_keys && strcmp(parent->keys[i], key) < 0) i++;
+    int i = node_upper_bound(parent, key_str(key));
     for (int j = parent->num_keys; j > i; j--) {
-        strcpy(parent->keys[j], parent->keys[j - 1]);
+        parent->keys[j] = parent->keys[j - 1];
+        parent->prefixes[j] = parent->prefixes[j - 1];
         parent->pointers[j + 1] = parent->pointers[j];
     }
-    strcpy(parent->keys[i], key);
+    node_set_key(parent, i, key);
     parent->pointers[i + 1] = new_node;
     new_node->parent = parent;
     parent->num_keys++;
-    if (parent->num_keys == ORDER - 1) {
+    node_refresh_prefixes(parent);
+    if (parent->num_keys == tree_order) {
         split_count++;
         Node* new_internal = create_node(false);
         new_internal->parent = parent->parent;
-        int split_point = (ORDER - 1) / 2;
-        char key_to_promote[MAX_LINE_LEN];
-        strcpy(key_to_promote, parent->keys[split_point]);
-        new_internal->num_keys = (ORDER - 1) - (split_point + 1);
+        int split_point = tree_order / 2;
+        KeyRef key_to_promote = parent->keys[split_point];
+        new_internal->num_keys = tree_order - (split_point + 1);
+        new_internal->prefix_len = parent->prefix_len;
         for (int j = 0; j < new_internal->num_keys; j++) {
-            strcpy(new_internal->keys[j], parent->keys[j + split_point + 1]);
+            new_internal->keys[j] = parent->keys[j + split_point + 1];
+            new_internal->prefixes[j] = parent->prefixes[j + split_point + 1];
             new_internal->pointers[j] = parent->pointers[j + split_point + 1];
             ((Node*)new_internal->pointers[j])->parent = new_internal;
         }
-        new_internal->pointers[new_internal->num_keys] = parent->pointers[ORDER-1];
-        if (new_internal->pointers[new_internal->num_keys] != NULL)
-            ((Node*)new_internal->pointers[new_internal->num_keys])->parent = new_internal;
+        new_internal->pointers[new_internal->num_keys] = parent->pointers[tree_order];
+        ((Node*)new_internal->pointers[new_internal->num_keys])->parent = new_internal;
         parent->num_keys = split_point;
+        node_refresh_prefixes(parent);
+        node_refresh_prefixes(new_internal);
         insert_into_parent(parent, key_to_promote, new_internal);
     }
 }
 
 void insert(const char* dept_name, const char* uni_name, float score){
+    tree_write_lock();
      if (root == NULL) {
         root = create_node(true);
         first_leaf = root;
     }
-    Node* leaf = find_leaf(root, dept_name);
-    insert_into_leaf(leaf, dept_name, uni_name, score);
+    //A known department only needs its ranking, not its leaf
+    RankList* list = use_hash_index ? dept_hash_find(dept_name) : NULL;
+    if (list != NULL) {
+        UniversityNode* new_uni = create_university(uni_name, score);
+        insert_into_sorted_list(list, new_uni);
+        uni_index_add(new_uni, list);
+        score_index_insert(new_uni, list);
+    } else {
+        Node* leaf = find_leaf(root, dept_name);
+        insert_into_leaf(leaf, dept_name, uni_name, score);
+    }
+    tree_write_unlock();
 }
 
 void free_tree(Node* node){
+    if (use_arena) {
+        //Every node and list entry lives in the arenas, so the whole tree goes in one step
+        arena_release(&node_arena);
+        arena_release(&uni_arena);
+        return;
+    }
     if (node == NULL) return;
     if (node->is_leaf) {
         for (int i = 0; i < node->num_keys; i++) {
-            UniversityNode* head = (UniversityNode*)node->pointers[i];
+            RankList* list = (RankList*)node->pointers[i];
+            UniversityNode* head = rank_list_first(list);
             UniversityNode* tmp;
-            while (head != NULL) { tmp = head; head = head->next; free(tmp); }
+            while (head != NULL) { tmp = head; head = head->links[0].next; free(tmp); }
+            free(list);
         }
     } else {
         for (int i = 0; i <= node->num_keys; i++) free_tree(node->pointers[i]);
@@ -262,65 +1912,253 @@ void free_tree(Node* node){
 }
 
 void load_data_from_csv(const char* filename){
-    FILE* file = fopen(filename, "r");
-    if (!file) { perror("Could not open file"); return; }
-    char line[512];
-    fgets(line, sizeof(line), file);
-    while (fgets(line, sizeof(line), file)) {
-        char id[MAX_LINE_LEN], uni_name[MAX_LINE_LEN], dept_name[MAX_LINE_LEN];
-        float score = 0.0;
-        sscanf(line, "%[^,],%[^,],%[^,],%f", id, uni_name, dept_name, &score);
-        if (strlen(dept_name) > 0 && strlen(uni_name) > 0) {
-            insert(dept_name, uni_name, score);
-        }
+    CsvReader reader;
+    if (!csv_open(&reader, filename)) { perror("Could not open file"); return; }
+    CsvField header[CSV_MAX_FIELDS];
+    csv_next_record(&reader, header, CSV_MAX_FIELDS);
+    Record record;
+    while (csv_read_record(&reader, &record, 1)) {
+        insert(record.dept_name, record.uni_name, record.score);
     }
-    fclose(file);
+    csv_close(&reader);
 }
 
-void insert_into_sorted_list(UniversityNode** head, UniversityNode* new_uni){
-    if (*head == NULL || (*head)->score < new_uni->score) {
-        new_uni->next = *head;
-        *head = new_uni;
-        return;
-    }
-    UniversityNode* current = *head;
-    while (current->next != NULL && current->next->score >= new_uni->score) {
-        current = current->next;
+//Geometric level with p = 1/4, drawn from a xorshift generator
+int random_skip_level() {
+    int level = 1;
+    while (level < SKIP_MAX_LEVEL) {
+        skip_seed ^= skip_seed << 13;
+        skip_seed ^= skip_seed >> 17;
+        skip_seed ^= skip_seed << 5;
+        if ((skip_seed & 3) != 0) break;
+        level++;
     }
-    new_uni->next = current->next;
-    current->next = new_uni;
+    return level;
 }
 
-Node* find_leaf(Node* current_node, const char* dept_name){
-    if (current_node == NULL) return NULL;
-    while (!current_node->is_leaf) {
-        int i = 0;
-        while (i < current_node->num_keys && strcmp(dept_name, current_node->keys[i]) >= 0) {
-            i++;
+//Rank order inside a department: score descending, then university name.
+//Full duplicates keep insertion order, so the new entry goes after them.
+bool ranks_before(const UniversityNode* a, float score, const char* name){
+    if (a->score != score) return a->score > score;
+    return strcmp(a->university_name, name) <= 0;
+}
+
+void insert_into_sorted_list(RankList* list, UniversityNode* new_uni){
+    SkipLink* update[SKIP_MAX_LEVEL];
+    int rank_at[SKIP_MAX_LEVEL];
+    SkipLink* x = list->head;
+    int rank = 0;
+    for (int l = list->level - 1; l >= 0; l--) {
+        while (x[l].next != NULL && ranks_before(x[l].next, new_uni->score, new_uni->university_name)) {
+            rank += x[l].width;
+            x = x[l].next->links;
         }
-        current_node = (Node*)current_node->pointers[i];
+        update[l] = x;
+        rank_at[l] = rank;
     }
-    return current_node;
+    int level = new_uni->level;
+    if (level > list->level) {
+        for (int l = list->level; l < level; l++) {
+            update[l] = list->head;
+            rank_at[l] = 0;
+            list->head[l].width = list->count;
+        }
+        list->level = level;
+    }
+    for (int l = 0; l < level; l++) {
+        new_uni->links[l].next = update[l][l].next;
+        update[l][l].next = new_uni;
+        new_uni->links[l].width = update[l][l].width - (rank_at[0] - rank_at[l]);
+        update[l][l].width = rank_at[0] - rank_at[l] + 1;
+    }
+    for (int l = level; l < list->level; l++) update[l][l].width++;
+    list->count++;
+    list->version++;
 }
 
-void run_sequential_insertion() {
-    load_data_from_csv("yok_atlas.csv");
+void rank_list_append_begin(RankListAppender* appender, RankList* list){
+    appender->list = list;
+    for (int l = 0; l < SKIP_MAX_LEVEL; l++) {
+        appender->last[l] = list->head;
+        appender->last_rank[l] = 0;
+    }
 }
 
-void run_bulk_loading() {
-    int num_runs = create_sorted_runs_replacement_selection("yok_atlas.csv");
-    if (num_runs <= 0) { printf("Error: Could not create sorted runs.\n"); return; }
-    
-    merge_runs(num_runs);
-    
-    build_tree_from_sorted_file("sorted_data.csv");
+//O(1) insertion for entries that arrive in rank order. Levels follow the rank
+//(every 4th entry reaches level 2, every 16th level 3, ...), which gives a
+//perfectly balanced list without drawing random levels.
+UniversityNode* rank_list_append(RankListAppender* appender, const char* name, float score){
+    UniversityNode* new_uni = create_university_node(name, score, rank_list_append_level(appender->list));
+    rank_list_append_node(appender, new_uni);
+    return new_uni;
+}
 
-    for (int i = 0; i < num_runs; i++) {
-        char fname[20];
-        sprintf(fname, "run_%d.tmp", i);
-        remove(fname);
+//Level of the entry appended next to list
+int rank_list_append_level(const RankList* list){
+    int level = 1;
+    for (int r = list->count + 1; (r & 3) == 0 && level < SKIP_MAX_LEVEL; r >>= 2) level++;
+    return level;
+}
+
+//Links new_uni, created with rank_list_append_level, behind the last entry
+void rank_list_append_node(RankListAppender* appender, UniversityNode* new_uni){
+    RankList* list = appender->list;
+    int rank = list->count + 1;
+    int level = new_uni->level;
+    for (int l = 0; l < level; l++) {
+        appender->last[l][l].next = new_uni;
+        appender->last[l][l].width = rank - appender->last_rank[l];
+        appender->last[l] = new_uni->links;
+        appender->last_rank[l] = rank;
     }
-    remove("sorted_data.csv");
+    for (int l = level; l < list->level; l++) appender->last[l][l].width++;
+    if (level > list->level) list->level = level;
+    list->count++;
+}
+
+//1-based rank lookup; NULL when the department has fewer than rank entries
+UniversityNode* rank_list_at(const RankList* list, int rank) {
+    COUNT(rank_queries, 1);
+    if (rank < 1 || rank > list->count) return NULL;
+    const SkipLink* x = list->head;
+    int traversed = 0;
+    for (int l = list->level - 1; l >= 0; l--) {
+        while (x[l].next != NULL && traversed + x[l].width <= rank) {
+            COUNT(list_hops, 1);
+            traversed += x[l].width;
+            if (traversed == rank) return x[l].next;
+            x = x[l].next->links;
+        }
+    }
+    return NULL;
+}
+
+UniversityNode* rank_list_first(const RankList* list) {
+    return list->head[0].next;
+}
+
+//1-based rank of an entry of the list. Entries ranking strictly before it are
+//skipped level by level; full duplicates are then stepped over on level 0.
+int rank_list_rank_of(const RankList* list, const UniversityNode* uni) {
+    const SkipLink* x = list->head;
+    int traversed = 0;
+    for (int l = list->level - 1; l >= 0; l--) {
+        while (x[l].next != NULL && x[l].next != uni && ranks_before(x[l].next, uni->score, uni->university_name) &&
+               !ranks_before(uni, x[l].next->score, x[l].next->university_name)) {
+            traversed += x[l].width;
+            x = x[l].next->links;
+        }
+    }
+    while (x[0].next != NULL && x[0].next != uni) {
+        traversed++;
+        x = x[0].next->links;
+    }
+    return x[0].next == uni ? traversed + 1 : 0;
+}
+
+//Unlinks the rank-th entry and returns it; the node itself is kept so it can be
+//linked again. Ranks are unique, so the predecessors are found by position.
+UniversityNode* rank_list_remove_at(RankList* list, int rank) {
+    if (rank < 1 || rank > list->count) return NULL;
+    SkipLink* update[SKIP_MAX_LEVEL];
+    SkipLink* x = list->head;
+    int traversed = 0;
+    for (int l = list->level - 1; l >= 0; l--) {
+        while (x[l].next != NULL && traversed + x[l].width < rank) {
+            traversed += x[l].width;
+            x = x[l].next->links;
+        }
+        update[l] = x;
+    }
+    UniversityNode* target = x[0].next;
+    for (int l = 0; l < list->level; l++) {
+        if (l < target->level) {
+            update[l][l].width += target->links[l].width - 1;
+            update[l][l].next = target->links[l].next;
+        } else {
+            update[l][l].width--;
+        }
+    }
+    while (list->level > 1 && list->head[list->level - 1].next == NULL) list->level--;
+    list->count--;
+    list->version++;
+    return target;
+}
+
+//Moves an entry to the position of its new score in its ranking and in the score index
+void update_score(RankList* list, UniversityNode* uni, float score) {
+    ScoreNode* node = score_index_unlink(uni, list);
+    rank_list_remove_at(list, rank_list_rank_of(list, uni));
+    uni->score = score;
+    insert_into_sorted_list(list, uni);
+    if (node != NULL) score_index_link(node);
+}
+
+Node* find_leaf(Node* current_node, const char* dept_name){
+    return find_leaf_with(current_node, dept_name, use_key_prefixes);
+}
+
+Node* find_leaf_with(Node* current_node, const char* dept_name, bool prefixes){
+    if (current_node == NULL) return NULL;
+    COUNT(find_leaf_calls, 1);
+    COUNT(nodes_visited, 1);
+    while (!current_node->is_leaf) {
+        current_node = (Node*)current_node->pointers[node_upper_bound_with(current_node, dept_name, prefixes)];
+        COUNT(nodes_visited, 1);
+    }
+    return current_node;
+}
+
+void run_sequential_insertion() {
+    load_data_from_csv(input_file);
+}
+
+//False when the input could not be sorted or a run turned out corrupt; the
+//partly built tree is dropped then
+bool run_bulk_loading() {
+    BulkOptions options = {sort_threads, leaf_fill_factor, internal_fill_factor, false};
+    return run_bulk_loading_with(&options);
+}
+
+bool run_bulk_loading_with(const BulkOptions* options) {
+    double start = wall_clock_seconds();
+    int num_runs = create_sorted_runs_replacement_selection(input_file, options->threads);
+    run_generation_seconds = wall_clock_seconds() - start;
+    if (num_runs < 0) { printf("Error: Could not create sorted runs.\n"); return false; }
+    if (num_runs == 0) return true;
+    
+    start = wall_clock_seconds();
+    int first_run = 0;
+    num_runs = merge_runs_multipass(&first_run, num_runs, options->single_run ? 1 : merge_fan_in());
+    merge_pass_seconds = wall_clock_seconds() - start;
+    tree_build_seconds = 0;
+    RunMerger merger;
+    bool ok = num_runs > 0 && merge_runs_begin(&merger, first_run, num_runs);
+    if (ok) {
+        double build_start = wall_clock_seconds();
+        build_threads = options->threads;
+        if (build_threads > 1) build_tree_parallel(&merger, options);
+        else build_tree_from_sorted_runs(&merger, options);
+        tree_build_seconds = wall_clock_seconds() - build_start;
+        ok = !merger.failed;
+        merge_runs_end(&merger);
+        if (ok) {
+            score_index_build();
+        } else {
+            free_tree(root);
+            free_key_store();
+            reset_metrics();
+        }
+    }
+    merge_build_seconds = wall_clock_seconds() - start;
+    if (!ok) printf("Error: Could not merge the sorted runs.\n");
+
+    for (int i = first_run; i < first_run + num_runs; i++) {
+        char fname[32];
+        run_file_name(fname, i);
+        remove(fname);
+    }
+    return ok;
 }
 
 //Bulk Loading Functions
@@ -328,258 +2166,3201 @@ void run_bulk_loading() {
 int compare_records(const void* a, const void* b){
     Record* rec1 = (Record*)a;
     Record* rec2 = (Record*)b;
+    //Department ascending, then the department's rank order (score descending,
+    //university ascending), then input order so the key is total
     int dept_cmp = strcmp(rec1->dept_name, rec2->dept_name);
     if (dept_cmp != 0) return dept_cmp;
-    else if (dept_cmp == 0)
-        return 0;
-    return rec2->score - rec1->score;
-}
-int create_sorted_runs_replacement_selection(const char* input_filename){
-    FILE* in = fopen(input_filename, "r");
-    if (!in) { perror("Could not open input file"); return -1; }
-    Record* primary_heap = (Record*)malloc(HEAP_SIZE * sizeof(Record));
-    Record* secondary_storage = (Record*)malloc(SECONDARY_STORAGE_SIZE * sizeof(Record));
-    if (!primary_heap || !secondary_storage) {
-        perror("Memory allocation error"); fclose(in); return -1;
-    }
-    char line[512];
-    fgets(line, sizeof(line), in);
+    if (rec1->score != rec2->score) return rec1->score > rec2->score ? -1 : 1;
+    int uni_cmp = strcmp(rec1->uni_name, rec2->uni_name);
+    if (uni_cmp != 0) return uni_cmp;
+    if (rec1->position != rec2->position) return rec1->position < rec2->position ? -1 : 1;
+    return 0;
+}
+//Replacement selection over one byte range of the input; runs are written as
+//run_<worker>_<n>.tmp. A record smaller than the last one written is tagged for
+//the next run and stays in the heap, so nothing is dropped and each run is
+//about twice the heap size on random input.
+void* run_generation_worker(void* arg){
+    RunWorker* worker = (RunWorker*)arg;
+    double start = wall_clock_seconds();
+    CsvReader* reader = &worker->reader;
+    COUNT(sort_bytes_read[SORT_RUN_GENERATION], reader->end - reader->pos);
+    int heap_capacity = worker->heap_capacity;
+    HeapEntry* heap = (HeapEntry*)malloc(heap_capacity * sizeof(HeapEntry));
+    if (!heap) { perror("Memory allocation error"); worker->failed = true; return NULL; }
+    int heap_size = 0;
+    while (heap_size < heap_capacity && csv_read_record(reader, &heap[heap_size].record, 1)) {
+        heap[heap_size].run = 0;
+        heap_size++;
+    }
+    for (int i = (heap_size / 2) - 1; i >= 0; i--) {
+        min_heapify_replacement(heap, heap_size, i);
+    }
+    int run_count = 0;
+    int current_run = -1;
+    RunFile out = {NULL, NULL, false};
+    while (heap_size > 0) {
+        HeapEntry top = heap[0];
+        if (top.run != current_run) {
+            if (!run_file_close(&out)) { perror("Could not write run file"); worker->failed = true; break; }
+            char out_fname[32];
+            sprintf(out_fname, "run_%d_%d.tmp", worker->worker_id, run_count);
+            if (!run_file_open(&out, out_fname, "wb")) { perror("Could not open temp file"); worker->failed = true; break; }
+            current_run = top.run;
+            run_count++;
+        }
+        if (!run_write_record(&out, &top.record)) { perror("Could not write run file"); worker->failed = true; break; }
+        if (csv_read_record(reader, &heap[0].record, 1)) {
+            heap[0].run = compare_records(&heap[0].record, &top.record) >= 0 ? top.run : top.run + 1;
+        } else {
+            heap[0] = heap[--heap_size];
+        }
+        if (heap_size > 0) {
+            min_heapify_replacement(heap, heap_size, 0);
+        }
+    }
+    if (!run_file_close(&out) && !worker->failed) { perror("Could not write run file"); worker->failed = true; }
+    free(heap);
+    worker->run_count = run_count;
+    worker->seconds = wall_clock_seconds() - start;
+    return NULL;
+}
+//Splits the input into up to max_workers byte ranges that start on line boundaries,
+//generates runs for each range in parallel and numbers them run_0..run_n-1 in
+//input order, so the merge sees the same runs for a given thread count.
+int create_sorted_runs_replacement_selection(const char* input_filename, int max_workers){
+    SET_SORT_PHASE(SORT_RUN_GENERATION);
+    CsvReader reader;
+    if (!csv_open(&reader, input_filename)) { perror("Could not open input file"); return -1; }
+    CsvField header[CSV_MAX_FIELDS];
+    csv_next_record(&reader, header, CSV_MAX_FIELDS);
+
+    size_t body_start = reader.pos;
+    size_t body_size = reader.size - body_start;
+    int num_workers = max_workers;
+    if ((size_t)num_workers > body_size / MIN_CHUNK_BYTES + 1) num_workers = (int)(body_size / MIN_CHUNK_BYTES + 1);
+    //Each worker gets an equal share of the budget, less its output buffer
+    size_t worker_budget = sort_memory_budget / num_workers;
+    size_t heap_bytes = worker_budget > RUN_BUFFER_SIZE ? worker_budget - RUN_BUFFER_SIZE : 0;
+    int heap_capacity = heap_bytes / sizeof(HeapEntry) > MIN_HEAP_ENTRIES ? (int)(heap_bytes / sizeof(HeapEntry)) : MIN_HEAP_ENTRIES;
+    RunWorker* workers = (RunWorker*)calloc(num_workers, sizeof(RunWorker));
+    pthread_t* threads = (pthread_t*)malloc(num_workers * sizeof(pthread_t));
+    if (!workers || !threads) {
+        perror("Memory allocation error"); free(workers); free(threads); csv_close(&reader); return -1;
+    }
+    size_t range_start = body_start;
+    for (int w = 0; w < num_workers; w++) {
+        size_t range_end = reader.size;
+        if (w < num_workers - 1) {
+            range_end = body_start + body_size / num_workers * (w + 1);
+            if (range_end < range_start) range_end = range_start;
+            while (range_end < reader.size && reader.data[range_end - 1] != '\n') range_end++;
+        }
+        workers[w].reader = reader;
+        workers[w].reader.mapped = false;
+        workers[w].reader.pos = range_start;
+        workers[w].reader.end = range_end;
+        workers[w].worker_id = w;
+        workers[w].heap_capacity = heap_capacity;
+        range_start = range_end;
+    }
+    if (num_workers == 1) {
+        run_generation_worker(&workers[0]);
+    } else {
+        int started = 0;
+        for (; started < num_workers; started++) {
+            if (pthread_create(&threads[started], NULL, run_generation_worker, &workers[started]) != 0) break;
+        }
+        //Ranges whose thread could not be started are processed here
+        for (int w = started; w < num_workers; w++) run_generation_worker(&workers[w]);
+        for (int w = 0; w < started; w++) pthread_join(threads[w], NULL);
+    }
+
     int run_count = 0;
-    bool more_input = true;
-    int current_heap_size = 0;
-    for (int i = 0; i < HEAP_SIZE && more_input; i++) {
-        if (!fgets(line, sizeof(line), in)) {
-            more_input = false;
+    bool failed = false;
+    for (int w = 0; w < num_workers; w++) {
+        if (workers[w].failed) failed = true;
+        for (int r = 0; r < workers[w].run_count; r++) {
+            char worker_fname[32], fname[32];
+            sprintf(worker_fname, "run_%d_%d.tmp", w, r);
+            run_file_name(fname, run_count++);
+            if (rename(worker_fname, fname) != 0) { perror("Could not rename run file"); failed = true; }
+        }
+    }
+    run_generation_threads = num_workers;
+    free(workers);
+    free(threads);
+    csv_close(&reader);
+    return failed ? -1 : run_count;
+}
+bool run_file_open(RunFile* run, const char* filename, const char* mode){
+    run->file = fopen(filename, mode);
+    run->corrupt = false;
+    if (!run->file) return false;
+    run->buffer = (char*)malloc(RUN_BUFFER_SIZE);
+    if (run->buffer) setvbuf(run->file, run->buffer, _IOFBF, RUN_BUFFER_SIZE);
+    return true;
+}
+//False when buffered data could not be flushed; a run written through run is then incomplete
+bool run_file_close(RunFile* run){
+    bool ok = run->file == NULL || fclose(run->file) == 0;
+    free(run->buffer);
+    run->file = NULL;
+    run->buffer = NULL;
+    return ok;
+}
+//Run record layout: uint16 university length, uint16 department length,
+//float score, uint64 input position, then both names without terminators
+bool run_write_record(RunFile* run, const Record* record){
+    uint16_t lengths[2] = {(uint16_t)strlen(record->uni_name), (uint16_t)strlen(record->dept_name)};
+    COUNT(sort_bytes_written[sort_phase], sizeof(lengths) + sizeof(float) + sizeof(uint64_t) + lengths[0] + lengths[1]);
+    return fwrite(lengths, sizeof(lengths), 1, run->file) == 1 &&
+           fwrite(&record->score, sizeof(float), 1, run->file) == 1 &&
+           fwrite(&record->position, sizeof(uint64_t), 1, run->file) == 1 &&
+           fwrite(record->uni_name, 1, lengths[0], run->file) == lengths[0] &&
+           fwrite(record->dept_name, 1, lengths[1], run->file) == lengths[1];
+}
+//False at the end of the run, and also for a malformed record, which sets corrupt
+bool run_read_record(RunFile* run, Record* record){
+    uint16_t lengths[2];
+    size_t got = fread(lengths, 1, sizeof(lengths), run->file);
+    if (got == 0 && !ferror(run->file)) return false;
+    if (got != sizeof(lengths) || lengths[0] >= MAX_LINE_LEN || lengths[1] >= MAX_LINE_LEN) {
+        run->corrupt = true;
+        return false;
+    }
+    COUNT(sort_bytes_read[sort_phase], sizeof(lengths) + sizeof(float) + sizeof(uint64_t) + lengths[0] + lengths[1]);
+    if (fread(&record->score, sizeof(float), 1, run->file) != 1 ||
+        fread(&record->position, sizeof(uint64_t), 1, run->file) != 1 ||
+        fread(record->uni_name, 1, lengths[0], run->file) != lengths[0] ||
+        fread(record->dept_name, 1, lengths[1], run->file) != lengths[1]) {
+        run->corrupt = true;
+        return false;
+    }
+    record->uni_name[lengths[0]] = '\0';
+    record->dept_name[lengths[1]] = '\0';
+    return true;
+}
+//Exhausted runs lose every match; ties go to the lower run index to keep the merge stable
+bool merge_run_less(const RunMerger* merger, int a, int b){
+    if (merger->exhausted[a]) return false;
+    if (merger->exhausted[b]) return true;
+    int cmp = compare_records(&merger->current[a], &merger->current[b]);
+    return cmp < 0 || (cmp == 0 && a < b);
+}
+//Plays the matches below node, storing each loser and returning the winner
+int loser_tree_build(RunMerger* merger, int node){
+    if (node >= merger->num_runs) return node - merger->num_runs;
+    int left = loser_tree_build(merger, 2 * node);
+    int right = loser_tree_build(merger, 2 * node + 1);
+    if (merge_run_less(merger, left, right)) {
+        merger->tree[node] = right;
+        return left;
+    }
+    merger->tree[node] = left;
+    return right;
+}
+bool merge_runs_begin(RunMerger* merger, int first_run, int num_runs){
+    memset(merger, 0, sizeof(RunMerger));
+    if (num_runs <= 0) return false;
+    merger->num_runs = num_runs;
+    merger->first_run = first_run;
+    merger->runs = (RunFile*)calloc(num_runs, sizeof(RunFile));
+    merger->current = (Record*)malloc(num_runs * sizeof(Record));
+    merger->exhausted = (bool*)calloc(num_runs, sizeof(bool));
+    merger->tree = (int*)calloc(num_runs, sizeof(int));
+    if (!merger->runs || !merger->current || !merger->exhausted || !merger->tree) {
+        perror("Merge memory allocation error"); merge_runs_end(merger); return false;
+    }
+    for (int i = 0; i < num_runs; i++) {
+        char fname[32];
+        run_file_name(fname, first_run + i);
+        if (!run_file_open(&merger->runs[i], fname, "rb")) { perror("Could not open run file"); merge_runs_end(merger); return false; }
+        merger->exhausted[i] = !run_read_record(&merger->runs[i], &merger->current[i]);
+        if (merger->runs[i].corrupt) {
+            fprintf(stderr, "Corrupt record in %s\n", fname);
+            merge_runs_end(merger);
+            return false;
+        }
+    }
+    merger->tree[0] = loser_tree_build(merger, 1);
+    return true;
+}
+//Hands out the next record in sorted order; one comparison per tree level. A
+//corrupt input ends the merge with failed set, so callers must check it.
+bool merge_runs_next(RunMerger* merger, Record* out){
+    int winner = merger->tree[0];
+    if (merger->num_runs == 0 || merger->failed || merger->exhausted[winner]) return false;
+    *out = merger->current[winner];
+    merger->exhausted[winner] = !run_read_record(&merger->runs[winner], &merger->current[winner]);
+    if (merger->runs[winner].corrupt) {
+        char fname[32];
+        run_file_name(fname, merger->first_run + winner);
+        fprintf(stderr, "Corrupt record in %s\n", fname);
+        merger->failed = true;
+    }
+    for (int node = (winner + merger->num_runs) / 2; node >= 1; node /= 2) {
+        if (merge_run_less(merger, merger->tree[node], winner)) {
+            int loser = winner;
+            winner = merger->tree[node];
+            merger->tree[node] = loser;
+        }
+    }
+    merger->tree[0] = winner;
+    return true;
+}
+void merge_runs_end(RunMerger* merger){
+    if (merger->runs) {
+        for (int i = 0; i < merger->num_runs; i++) run_file_close(&merger->runs[i]);
+    }
+    free(merger->runs);
+    free(merger->current);
+    free(merger->exhausted);
+    free(merger->tree);
+    memset(merger, 0, sizeof(RunMerger));
+}
+//Runs one loser tree can merge: each input needs a RUN_BUFFER_SIZE buffer and a
+//current record, plus one output buffer, and every input holds a descriptor
+int merge_fan_in(){
+    size_t per_input = RUN_BUFFER_SIZE + sizeof(Record);
+    size_t fan_in = sort_memory_budget > per_input ? sort_memory_budget / per_input - 1 : 2;
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur > 32) {
+        if (fan_in > limit.rlim_cur - 16) fan_in = limit.rlim_cur - 16;
+    }
+    if (fan_in < 2) fan_in = 2;
+    if (fan_in > INT32_MAX) fan_in = INT32_MAX;
+    return (int)fan_in;
+}
+//Merges groups of fan_in runs into new runs until at most max_runs are left,
+//so a single pass can finish the job when max_runs is the fan-in. Inputs are
+//deleted once the run they were merged into is closed. Returns the number of remaining
+//runs and stores the index of the first one in first_run, or -1 on error.
+int merge_runs_multipass(int* first_run, int num_runs, int max_runs){
+    int fan_in = merge_fan_in();
+    int next_run = *first_run + num_runs;
+    merge_passes = 1;
+    SET_SORT_PHASE(SORT_MERGE_PASSES);
+    while (num_runs > max_runs) {
+        int pass_first = next_run;
+        int input = *first_run;
+        int remaining = num_runs;
+        while (remaining > 0) {
+            int group = remaining < fan_in ? remaining : fan_in;
+            RunMerger merger;
+            RunFile out;
+            char fname[32];
+            run_file_name(fname, next_run);
+            if (!merge_runs_begin(&merger, input, group)) return -1;
+            if (!run_file_open(&out, fname, "wb")) { perror("Could not open temp file"); merge_runs_end(&merger); return -1; }
+            Record record;
+            bool written = true;
+            while (written && merge_runs_next(&merger, &record)) written = run_write_record(&out, &record);
+            if (!run_file_close(&out)) written = false;
+            bool failed = merger.failed;
+            merge_runs_end(&merger);
+            //The inputs go only once their records are safely in the output
+            if (!written) perror("Could not write run file");
+            if (failed || !written) { remove(fname); return -1; }
+            for (int i = input; i < input + group; i++) {
+                run_file_name(fname, i);
+                remove(fname);
+            }
+            input += group;
+            remaining -= group;
+            next_run++;
+        }
+        *first_run = pass_first;
+        num_runs = next_run - pass_first;
+        merge_passes++;
+    }
+    SET_SORT_PHASE(SORT_FINAL_MERGE); //The caller merges what is left
+    return num_runs;
+}
+void run_file_name(char* buf, int index){
+    sprintf(buf, "run_%d.tmp", index);
+}
+void builder_begin(TreeBuilder* builder, const BulkOptions* options){
+    memset(builder, 0, sizeof(TreeBuilder));
+    builder->leaf_fill = (int)((tree_order - 1) * options->leaf_fill);
+    builder->internal_fill = (int)((tree_order - 1) * options->internal_fill);
+    if (builder->leaf_fill < 1) builder->leaf_fill = 1;
+    if (builder->internal_fill < 1) builder->internal_fill = 1;
+    root = NULL;
+    first_leaf = NULL;
+}
+//Hangs child to the right of spine[level - 1], opening new nodes up the spine as levels fill
+void builder_append_child(TreeBuilder* builder, int level, KeyRef separator, Node* child){
+    if (level == builder->height) {
+        if (level == MAX_TREE_HEIGHT) { fprintf(stderr, "Tree height limit exceeded\n"); exit(1); }
+        Node* new_root = create_node(false);
+        new_root->pointers[0] = builder->spine[level - 1];
+        builder->spine[level - 1]->parent = new_root;
+        builder->spine[level] = new_root;
+        builder->height++;
+    }
+    Node* parent = builder->spine[level];
+    if (parent->num_keys == builder->internal_fill) {
+        split_count++;
+        Node* new_parent = create_node(false);
+        new_parent->pointers[0] = child;
+        child->parent = new_parent;
+        builder_append_child(builder, level + 1, separator, new_parent);
+        builder->spine[level] = new_parent;
+        return;
+    }
+    node_set_key(parent, parent->num_keys, separator);
+    parent->pointers[parent->num_keys + 1] = child;
+    parent->num_keys++;
+    node_refresh_prefixes(parent);
+    child->parent = parent;
+}
+//Appends the next department in key order
+void builder_add(TreeBuilder* builder, KeyRef key, RankList* list){
+    Node* leaf = builder->spine[0];
+    if (leaf == NULL) {
+        leaf = create_node(true);
+        builder->spine[0] = leaf;
+        builder->height = 1;
+        first_leaf = leaf;
+    } else if (leaf->num_keys == builder->leaf_fill) {
+        split_count++;
+        Node* new_leaf = create_node(true);
+        leaf->next = new_leaf;
+        builder_append_child(builder, 1, separator_between(leaf->keys[leaf->num_keys - 1], key), new_leaf);
+        builder->spine[0] = new_leaf;
+        leaf = new_leaf;
+    }
+    node_set_key(leaf, leaf->num_keys, key);
+    dept_hash_insert(key, list);
+    leaf->pointers[leaf->num_keys] = list;
+    leaf->num_keys++;
+    node_refresh_prefixes(leaf);
+}
+//The last node opened on each level may hold a single entry. Top-down, each one
+//borrows from its left sibling until it reaches the minimum fill a delete keeps,
+//which also gives the spine node below a left sibling to borrow from.
+void builder_finish(TreeBuilder* builder){
+    if (builder->height == 0) return;
+    root = builder->spine[builder->height - 1];
+    root->parent = NULL;
+    for (int level = builder->height - 2; level >= 0; level--) {
+        Node* node = builder->spine[level];
+        Node* parent = node->parent;
+        if (parent->num_keys == 0) continue;
+        Node* left = (Node*)parent->pointers[parent->num_keys - 1];
+        int min_keys = node->is_leaf ? tree_order / 2 : (tree_order + 1) / 2 - 1;
+        while (node->num_keys < min_keys && left->num_keys > min_keys) borrow_from_left(node, left, parent->num_keys - 1);
+    }
+}
+//Streams the merged runs into the tree, keeping only the right spine open
+void build_tree_from_sorted_runs(RunMerger* merger, const BulkOptions* options){
+    TreeBuilder builder;
+    builder_begin(&builder, options);
+    char last_dept_name[MAX_LINE_LEN] = "";
+    RankListAppender appender = {NULL};
+    Record record;
+    //Records arrive in (department, rank) order, so every list is filled by appending
+    while (merge_runs_next(merger, &record)) {
+        if (appender.list == NULL || strcmp(record.dept_name, last_dept_name) != 0) {
+            RankList* list = create_rank_list();
+            list->key = key_store_add(record.dept_name);
+            builder_add(&builder, list->key, list);
+            rank_list_append_begin(&appender, list);
+            strcpy(last_dept_name, record.dept_name);
+        }
+        uni_index_add(rank_list_append(&appender, record.uni_name, record.score), appender.list);
+    }
+    builder_finish(&builder);
+}
+//Parallel variant of build_tree_from_sorted_runs. This thread merges and cuts the
+//stream into segments at department boundaries while the workers build the
+//rankings of one segment each. The segments are stitched in stream order, then
+//the leaves and every internal level are built in slices by threads. Node
+//boundaries, separators and the spine fixup are those of the serial builder, so
+//both give the same tree.
+void build_tree_parallel(RunMerger* merger, const BulkOptions* options){
+    int threads = options->threads;
+    SegmentQueue queue;
+    memset(&queue, 0, sizeof(SegmentQueue));
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.changed, NULL);
+    pthread_t* handles = (pthread_t*)malloc(threads * sizeof(pthread_t));
+    if (!handles) { perror("Memory allocation error"); exit(1); }
+    int started = 0;
+    for (; started < threads; started++) {
+        if (pthread_create(&handles[started], NULL, segment_worker, &queue) != 0) break;
+    }
+    Record pending;
+    bool more = merge_runs_next(merger, &pending);
+    while (more) {
+        long capacity = BUILD_SEGMENT_RECORDS;
+        BuildSegment* segment = (BuildSegment*)calloc(1, sizeof(BuildSegment));
+        if (segment) segment->records = (Record*)malloc(capacity * sizeof(Record));
+        if (!segment || !segment->records) { perror("Memory allocation error"); exit(1); }
+        //A department never straddles two segments
+        while (more && (segment->record_count < BUILD_SEGMENT_RECORDS ||
+                        strcmp(pending.dept_name, segment->records[segment->record_count - 1].dept_name) == 0)) {
+            if (segment->record_count == capacity) {
+                capacity *= 2;
+                Record* records = (Record*)realloc(segment->records, capacity * sizeof(Record));
+                if (!records) { perror("Memory allocation error"); exit(1); }
+                segment->records = records;
+            }
+            segment->records[segment->record_count++] = pending;
+            more = merge_runs_next(merger, &pending);
+        }
+        pthread_mutex_lock(&queue.lock);
+        while (started > 0 && queue.produced - queue.finished >= 2L * threads) pthread_cond_wait(&queue.changed, &queue.lock);
+        if (queue.produced == queue.capacity) {
+            queue.capacity = queue.capacity ? queue.capacity * 2 : 64;
+            BuildSegment** segments = (BuildSegment**)realloc(queue.segments, queue.capacity * sizeof(BuildSegment*));
+            if (!segments) { perror("Memory allocation error"); exit(1); }
+            queue.segments = segments;
+        }
+        queue.segments[queue.produced++] = segment;
+        pthread_cond_broadcast(&queue.changed);
+        pthread_mutex_unlock(&queue.lock);
+    }
+    pthread_mutex_lock(&queue.lock);
+    queue.done = true;
+    pthread_cond_broadcast(&queue.changed);
+    pthread_mutex_unlock(&queue.lock);
+    //Without a single worker the segments are built here
+    if (started == 0) segment_worker(&queue);
+    for (int t = 0; t < started; t++) pthread_join(handles[t], NULL);
+    free(handles);
+    pthread_mutex_destroy(&queue.lock);
+    pthread_cond_destroy(&queue.changed);
+
+    long department_count = 0;
+    for (long s = 0; s < queue.produced; s++) department_count += queue.segments[s]->list_count;
+    RankList** lists = (RankList**)malloc((department_count > 0 ? department_count : 1) * sizeof(RankList*));
+    if (!lists) { perror("Memory allocation error"); exit(1); }
+    long d = 0;
+    for (long s = 0; s < queue.produced; s++) {
+        BuildSegment* segment = queue.segments[s];
+        KeyRef base = key_store_append(&key_store, segment->keys.data, segment->keys.used);
+        for (long i = 0; i < segment->list_count; i++) {
+            RankList* list = segment->lists[i];
+            list->key += base;
+            lists[d++] = list;
+            uni_node_allocations += list->count;
+        }
+        rank_list_allocations += segment->list_count;
+        uni_node_bytes += segment->entry_bytes;
+        arena_splice(&uni_arena, &segment->arena);
+        free(segment->keys.data);
+        free(segment->lists);
+        free(segment);
+    }
+    free(queue.segments);
+    build_levels(lists, department_count, options);
+    //Both indexes take departments in key order, as from builder_add
+    for (d = 0; d < department_count; d++) {
+        dept_hash_insert(lists[d]->key, lists[d]);
+        for (UniversityNode* uni = rank_list_first(lists[d]); uni != NULL; uni = uni->links[0].next) uni_index_add(uni, lists[d]);
+    }
+    free(lists);
+}
+//Takes segments off the queue until the merging thread is done and none are left
+void* segment_worker(void* arg){
+    SegmentQueue* queue = (SegmentQueue*)arg;
+    pthread_mutex_lock(&queue->lock);
+    while (true) {
+        while (queue->taken == queue->produced && !queue->done) pthread_cond_wait(&queue->changed, &queue->lock);
+        if (queue->taken == queue->produced) break;
+        BuildSegment* segment = queue->segments[queue->taken++];
+        pthread_mutex_unlock(&queue->lock);
+        build_segment(segment);
+        pthread_mutex_lock(&queue->lock);
+        queue->finished++;
+        pthread_cond_broadcast(&queue->changed);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+//Fills the segment's rankings by appending, as build_tree_from_sorted_runs does,
+//with the allocation counts kept in the segment until it is stitched
+void build_segment(BuildSegment* segment){
+    RankListAppender appender = {NULL};
+    for (long i = 0; i < segment->record_count; i++) {
+        const Record* record = &segment->records[i];
+        if (i == 0 || strcmp(record->dept_name, record[-1].dept_name) != 0) {
+            if (segment->list_count == segment->list_capacity) {
+                segment->list_capacity = segment->list_capacity ? segment->list_capacity * 2 : 256;
+                RankList** lists = (RankList**)realloc(segment->lists, segment->list_capacity * sizeof(RankList*));
+                if (!lists) { perror("Memory allocation error"); exit(1); }
+                segment->lists = lists;
+            }
+            RankList* list = create_rank_list_in(&segment->arena);
+            list->key = key_store_append(&segment->keys, record->dept_name, strlen(record->dept_name) + 1);
+            segment->lists[segment->list_count++] = list;
+            rank_list_append_begin(&appender, list);
+        }
+        int level = rank_list_append_level(appender.list);
+        rank_list_append_node(&appender, create_university_in(&segment->arena, record->uni_name, record->score, level));
+        segment->entry_bytes += sizeof(UniversityNode) + (size_t)level * sizeof(SkipLink);
+    }
+    free(segment->records);
+    segment->records = NULL;
+}
+//Builds the leaves over lists, then internal levels until one node is left. Node
+//k of a level holds what builder_add and builder_append_child would have put in
+//the k-th node they opened on it; the last node of each level forms the spine.
+void build_levels(RankList** lists, long count, const BulkOptions* options){
+    int threads = options->threads;
+    TreeBuilder builder;
+    builder_begin(&builder, options);
+    if (count == 0) return;
+    LevelBuild level;
+    memset(&level, 0, sizeof(LevelBuild));
+    level.leaves = true;
+    level.fill = builder.leaf_fill;
+    level.lists = lists;
+    level.list_count = count;
+    level.count = (count + level.fill - 1) / level.fill;
+    level.nodes = (Node**)malloc(level.count * sizeof(Node*));
+    level.separators = (KeyRef*)malloc(level.count * sizeof(KeyRef));
+    if (!level.nodes || !level.separators) { perror("Memory allocation error"); exit(1); }
+    //Separators may grow key_store, so they are made before any worker reads it.
+    //The leftmost node has none above it; it gets its first key, which every
+    //level copies up unused.
+    level.separators[0] = lists[0]->key;
+    for (long k = 1; k < level.count; k++) level.separators[k] = separator_between(lists[k * level.fill - 1]->key, lists[k * level.fill]->key);
+    run_level(&level, threads);
+    first_leaf = level.nodes[0];
+    while (true) {
+        if (builder.height == MAX_TREE_HEIGHT) { fprintf(stderr, "Tree height limit exceeded\n"); exit(1); }
+        builder.spine[builder.height++] = level.nodes[level.count - 1];
+        node_allocations += level.count;
+        split_count += level.count - 1;
+        if (level.count == 1) break;
+        LevelBuild parents;
+        memset(&parents, 0, sizeof(LevelBuild));
+        parents.fill = builder.internal_fill;
+        parents.children = level.nodes;
+        parents.child_separators = level.separators;
+        parents.child_count = level.count;
+        parents.count = (level.count + parents.fill) / (parents.fill + 1);
+        parents.nodes = (Node**)malloc(parents.count * sizeof(Node*));
+        parents.separators = (KeyRef*)malloc(parents.count * sizeof(KeyRef));
+        if (!parents.nodes || !parents.separators) { perror("Memory allocation error"); exit(1); }
+        run_level(&parents, threads);
+        free(level.nodes);
+        free(level.separators);
+        level = parents;
+    }
+    free(level.nodes);
+    free(level.separators);
+    builder_finish(&builder);
+}
+//Builds the level in up to threads contiguous slices, then links the leaf
+//chain across slice boundaries and hands the slices' arenas to node_arena
+void run_level(LevelBuild* build, int threads){
+    if (threads > build->count) threads = (int)build->count;
+    LevelWorker* workers = (LevelWorker*)calloc(threads, sizeof(LevelWorker));
+    pthread_t* handles = (pthread_t*)malloc(threads * sizeof(pthread_t));
+    if (!workers || !handles) { perror("Memory allocation error"); exit(1); }
+    for (int w = 0; w < threads; w++) {
+        workers[w].build = build;
+        workers[w].first = build->count * w / threads;
+        workers[w].last = build->count * (w + 1) / threads;
+    }
+    int started = 0;
+    if (threads > 1) {
+        for (; started < threads; started++) {
+            if (pthread_create(&handles[started], NULL, level_worker, &workers[started]) != 0) break;
+        }
+    }
+    //Slices whose thread could not be started are built here
+    for (int w = started; w < threads; w++) level_worker(&workers[w]);
+    for (int w = 0; w < started; w++) pthread_join(handles[w], NULL);
+    for (int w = 0; w < threads; w++) {
+        if (build->leaves && w > 0) build->nodes[workers[w].first - 1]->next = build->nodes[workers[w].first];
+        arena_splice(&node_arena, &workers[w].arena);
+    }
+    free(workers);
+    free(handles);
+}
+void* level_worker(void* arg){
+    LevelWorker* worker = (LevelWorker*)arg;
+    LevelBuild* build = worker->build;
+    for (long k = worker->first; k < worker->last; k++) {
+        Node* node = create_node_in(&worker->arena, build->leaves);
+        if (build->leaves) {
+            long first = k * build->fill;
+            int n = build->list_count - first < build->fill ? (int)(build->list_count - first) : build->fill;
+            for (int i = 0; i < n; i++) {
+                node_set_key(node, i, build->lists[first + i]->key);
+                node->pointers[i] = build->lists[first + i];
+            }
+            node->num_keys = n;
+            if (k > worker->first) build->nodes[k - 1]->next = node;
+        } else {
+            long first = k * (build->fill + 1);
+            int n = build->child_count - first < build->fill + 1 ? (int)(build->child_count - first) : build->fill + 1;
+            for (int i = 0; i < n; i++) {
+                Node* child = build->children[first + i];
+                if (i > 0) node_set_key(node, i - 1, build->child_separators[first + i]);
+                node->pointers[i] = child;
+                child->parent = node;
+            }
+            node->num_keys = n - 1;
+            build->separators[k] = build->child_separators[first];
+        }
+        node_refresh_prefixes(node);
+        build->nodes[k] = node;
+    }
+    return NULL;
+}
+int compare_heap_entries(const HeapEntry* a, const HeapEntry* b){
+    if (a->run != b->run) return a->run < b->run ? -1 : 1;
+    return compare_records(&a->record, &b->record);
+}
+void swap_heap_entries(HeapEntry* a, HeapEntry* b){
+    HeapEntry temp = *a; *a = *b; *b = temp;
+}
+void min_heapify_replacement(HeapEntry heap[], int size, int i){
+    int smallest = i; int left = 2 * i + 1; int right = 2 * i + 2;
+    if (left < size && compare_heap_entries(&heap[left], &heap[smallest]) < 0) smallest = left;
+    if (right < size && compare_heap_entries(&heap[right], &heap[smallest]) < 0) smallest = right;
+    if (smallest != i) {
+        swap_heap_entries(&heap[i], &heap[smallest]);
+        min_heapify_replacement(heap, size, smallest);
+    }
+}
+
+
+//Index File Functions
+
+uint32_t crc32_update(uint32_t crc, const void* data, size_t len) {
+    static uint32_t table[256];
+    static bool table_ready = false;
+    if (!table_ready) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+        table_ready = true;
+    }
+    const uint8_t* p = (const uint8_t*)data;
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+//Page size that fits one node of the given order, rounded up to INDEX_PAGE_SIZE
+uint32_t index_page_size(int order) {
+    size_t keys = (size_t)(order - 1) * sizeof(uint32_t);
+    size_t children = (size_t)order * sizeof(uint32_t);
+    size_t values = (size_t)(order - 1) * sizeof(PagedValue);
+    size_t bytes = sizeof(PagedNode) + keys + (children > values ? children : values);
+    return (uint32_t)((bytes + INDEX_PAGE_SIZE - 1) / INDEX_PAGE_SIZE * INDEX_PAGE_SIZE);
+}
+
+//Appends s to the string pool of an index being written; identical strings share one offset
+uint32_t index_intern(IndexWriter* writer, const char* s) {
+    uint32_t hash = hash_key(s);
+    if ((writer->string_count + 1) * 2 > writer->slot_count) {
+        size_t new_slot_count = writer->slot_count ? writer->slot_count * 2 : 1024;
+        uint32_t* slots = (uint32_t*)malloc(new_slot_count * sizeof(uint32_t));
+        if (!slots) { perror("Index allocation failed"); exit(1); }
+        memset(slots, 0xFF, new_slot_count * sizeof(uint32_t));
+        for (size_t i = 0; i < writer->slot_count; i++) {
+            uint32_t offset = writer->slots[i];
+            if (offset == UINT32_MAX) continue;
+            size_t j = hash_key(writer->strings.data + offset) & (new_slot_count - 1);
+            while (slots[j] != UINT32_MAX) j = (j + 1) & (new_slot_count - 1);
+            slots[j] = offset;
+        }
+        free(writer->slots);
+        writer->slots = slots;
+        writer->slot_count = new_slot_count;
+    }
+    size_t j = hash & (writer->slot_count - 1);
+    while (writer->slots[j] != UINT32_MAX) {
+        if (strcmp(writer->strings.data + writer->slots[j], s) == 0) return writer->slots[j];
+        j = (j + 1) & (writer->slot_count - 1);
+    }
+    size_t len = strlen(s) + 1;
+    if (writer->strings.used + len > writer->strings.capacity) {
+        size_t new_capacity = writer->strings.capacity ? writer->strings.capacity * 2 : 4096;
+        while (new_capacity < writer->strings.used + len) new_capacity *= 2;
+        char* data = (char*)realloc(writer->strings.data, new_capacity);
+        if (!data) { perror("Index allocation failed"); exit(1); }
+        writer->strings.data = data;
+        writer->strings.capacity = new_capacity;
+    }
+    uint32_t offset = (uint32_t)writer->strings.used;
+    memcpy(writer->strings.data + offset, s, len);
+    writer->strings.used += len;
+    writer->slots[j] = offset;
+    writer->string_count++;
+    return offset;
+}
+
+//Writes bytes to the index body and folds them into the running checksum
+bool index_write(IndexWriter* writer, const void* data, size_t len) {
+    writer->checksum = crc32_update(writer->checksum, data, len);
+    writer->written += len;
+    return fwrite(data, 1, len, writer->file) == len;
+}
+
+bool index_pad_to_page(IndexWriter* writer) {
+    static const uint8_t zeros[INDEX_PAGE_SIZE] = {0};
+    size_t page_size = writer->header.page_size;
+    size_t padding = (page_size - writer->written % page_size) % page_size;
+    while (padding > 0) {
+        size_t chunk = padding < sizeof(zeros) ? padding : sizeof(zeros);
+        if (!index_write(writer, zeros, chunk)) return false;
+        padding -= chunk;
+    }
+    return true;
+}
+
+//Saves the tree as: header page, node pages in level order (page id = position
+//in the file), then the string pool and the per-department ranking entries.
+//Internal nodes store child page ids and leaves store entry ranges instead of pointers.
+bool save_index(const char* filename) {
+    if (root == NULL) { printf("Tree is empty. Nothing to save.\n"); return false; }
+    IndexWriter writer;
+    memset(&writer, 0, sizeof(IndexWriter));
+    writer.header.magic = INDEX_MAGIC;
+    writer.header.version = INDEX_VERSION;
+    writer.header.page_size = index_page_size(tree_order);
+    writer.header.order = (uint32_t)tree_order;
+    writer.header.height = (uint32_t)calculate_tree_height();
+    writer.file = fopen(filename, "wb");
+    if (!writer.file) { perror("Could not open index file"); return false; }
+
+    //Level-order list of nodes; a node's children get consecutive page ids
+    size_t node_count = 0, node_capacity = 1024;
+    Node** nodes = (Node**)malloc(node_capacity * sizeof(Node*));
+    if (!nodes) { perror("Index allocation failed"); fclose(writer.file); return false; }
+    nodes[node_count++] = root;
+    for (size_t i = 0; i < node_count; i++) {
+        if (nodes[i]->is_leaf) continue;
+        for (int c = 0; c <= nodes[i]->num_keys; c++) {
+            if (node_count == node_capacity) {
+                node_capacity *= 2;
+                Node** grown = (Node**)realloc(nodes, node_capacity * sizeof(Node*));
+                if (!grown) { perror("Index allocation failed"); free(nodes); fclose(writer.file); return false; }
+                nodes = grown;
+            }
+            nodes[node_count++] = (Node*)nodes[i]->pointers[c];
+        }
+    }
+    writer.header.node_pages = (uint32_t)node_count;
+    writer.header.root_page = 1;
+
+    uint8_t* page = (uint8_t*)calloc(1, writer.header.page_size);
+    PagedEntry* entries = NULL;
+    size_t entry_count = 0, entry_capacity = 0;
+    bool ok = page != NULL && fseek(writer.file, writer.header.page_size, SEEK_SET) == 0;
+    uint32_t next_child_page = 2;
+    for (size_t i = 0; i < node_count && ok; i++) {
+        Node* node = nodes[i];
+        memset(page, 0, writer.header.page_size);
+        PagedNode* paged = (PagedNode*)page;
+        uint32_t* keys = (uint32_t*)(paged + 1);
+        paged->is_leaf = node->is_leaf;
+        paged->num_keys = (uint32_t)node->num_keys;
+        for (int k = 0; k < node->num_keys; k++) keys[k] = index_intern(&writer, key_str(node->keys[k]));
+        if (node->is_leaf) {
+            if (writer.header.first_leaf_page == 0) writer.header.first_leaf_page = (uint32_t)(i + 1);
+            //Leaves are the last level, so the following node is the next leaf
+            paged->next_page = (i + 1 < node_count) ? (uint32_t)(i + 2) : 0;
+            PagedValue* values = (PagedValue*)(keys + tree_order - 1);
+            for (int k = 0; k < node->num_keys; k++) {
+                RankList* list = (RankList*)node->pointers[k];
+                values[k].first_entry = (uint32_t)entry_count;
+                values[k].count = (uint32_t)list->count;
+                if (entry_count + list->count > entry_capacity) {
+                    size_t new_capacity = entry_capacity ? entry_capacity * 2 : 4096;
+                    while (new_capacity < entry_count + list->count) new_capacity *= 2;
+                    PagedEntry* grown = (PagedEntry*)realloc(entries, new_capacity * sizeof(PagedEntry));
+                    if (!grown) { perror("Index allocation failed"); ok = false; break; }
+                    entries = grown;
+                    entry_capacity = new_capacity;
+                }
+                for (UniversityNode* u = rank_list_first(list); u != NULL; u = u->links[0].next) {
+                    entries[entry_count].name_offset = index_intern(&writer, u->university_name);
+                    entries[entry_count].score = u->score;
+                    entry_count++;
+                }
+            }
+        } else {
+            uint32_t* children = keys + tree_order - 1;
+            for (int c = 0; c <= node->num_keys; c++) children[c] = next_child_page++;
+        }
+        ok = ok && index_write(&writer, page, writer.header.page_size);
+    }
+    writer.header.string_offset = writer.header.page_size + writer.written;
+    writer.header.string_bytes = writer.strings.used;
+    ok = ok && index_write(&writer, writer.strings.data, writer.strings.used) && index_pad_to_page(&writer);
+    writer.header.entry_offset = writer.header.page_size + writer.written;
+    writer.header.entry_count = entry_count;
+    ok = ok && index_write(&writer, entries, entry_count * sizeof(PagedEntry)) && index_pad_to_page(&writer);
+    writer.header.file_size = writer.header.page_size + writer.written;
+    writer.header.body_checksum = writer.checksum;
+    writer.header.header_checksum = crc32_update(0, &writer.header, offsetof(IndexHeader, header_checksum));
+    if (ok) {
+        memset(page, 0, writer.header.page_size);
+        memcpy(page, &writer.header, sizeof(IndexHeader));
+        ok = fseek(writer.file, 0, SEEK_SET) == 0 && fwrite(page, 1, writer.header.page_size, writer.file) == writer.header.page_size;
+    }
+    if (fclose(writer.file) != 0) ok = false;
+    free(page);
+    free(nodes);
+    free(entries);
+    free(writer.slots);
+    free(writer.strings.data);
+    if (!ok) { perror("Could not write index file"); remove(filename); }
+    return ok;
+}
+
+//Maps an index file read-only. Only the header, and the layout it describes, is
+//validated unless verify is set, so opening costs the same regardless of the
+//index size. Page ids, entry ranges and string offsets read from the body are
+//checked as queries reach them.
+bool paged_index_open(PagedIndex* index, const char* filename, bool verify) {
+    memset(index, 0, sizeof(PagedIndex));
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) { perror("Could not open index file"); return false; }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(IndexHeader)) {
+        fprintf(stderr, "Index file is truncated.\n"); close(fd); return false;
+    }
+    void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) { perror("Could not map index file"); return false; }
+    index->base = (const uint8_t*)data;
+    index->size = (size_t)st.st_size;
+    const IndexHeader* header = (const IndexHeader*)index->base;
+    const char* error = NULL;
+    if (header->magic != INDEX_MAGIC) error = "not an index file";
+    else if (header->version != INDEX_VERSION) error = "unsupported index version";
+    else if (header->header_checksum != crc32_update(0, header, offsetof(IndexHeader, header_checksum))) error = "header checksum mismatch";
+    else if (header->file_size != index->size || header->page_size < INDEX_PAGE_SIZE) error = "index file size mismatch";
+    else if (header->page_size % INDEX_PAGE_SIZE != 0 || header->order < MIN_ORDER || header->order > MAX_ORDER ||
+             index_page_size((int)header->order) > header->page_size) error = "bad page layout";
+    else if (header->node_pages == 0 || header->height == 0 || header->height > MAX_TREE_HEIGHT ||
+             header->root_page == 0 || header->root_page > header->node_pages ||
+             header->first_leaf_page == 0 || header->first_leaf_page > header->node_pages) error = "bad node pages";
+    else if (header->string_offset < ((uint64_t)header->node_pages + 1) * header->page_size ||
+             header->string_offset > index->size || header->string_bytes > index->size - header->string_offset ||
+             (header->string_bytes > 0 && index->base[header->string_offset + header->string_bytes - 1] != '\0')) error = "bad string pool";
+    else if (header->entry_offset % sizeof(uint32_t) != 0 || header->entry_offset > index->size ||
+             header->entry_count > (index->size - header->entry_offset) / sizeof(PagedEntry)) error = "bad entry array";
+    else if (verify && header->body_checksum != crc32_update(0, index->base + header->page_size, index->size - header->page_size)) error = "body checksum mismatch";
+    if (error != NULL) {
+        fprintf(stderr, "Invalid index file: %s.\n", error);
+        paged_index_close(index);
+        return false;
+    }
+    madvise(data, index->size, MADV_RANDOM);
+    index->header = header;
+    index->strings = (const char*)(index->base + header->string_offset);
+    index->entries = (const PagedEntry*)(index->base + header->entry_offset);
+    return true;
+}
+
+void paged_index_close(PagedIndex* index) {
+    if (index->base) munmap((void*)index->base, index->size);
+    memset(index, 0, sizeof(PagedIndex));
+}
+
+//A body that fails a check is not used any further
+void paged_index_corrupt(const char* what) {
+    fprintf(stderr, "Invalid index file: %s.\n", what);
+    exit(1);
+}
+
+const PagedNode* paged_node(const PagedIndex* index, uint32_t page_id) {
+    if (page_id == 0 || page_id > index->header->node_pages) paged_index_corrupt("page id out of range");
+    const PagedNode* node = (const PagedNode*)(index->base + (size_t)page_id * index->header->page_size);
+    if (node->is_leaf > 1 || node->num_keys > index->header->order - 1) paged_index_corrupt("malformed node page");
+    return node;
+}
+
+//The string pool ends in a NUL, so any offset inside it yields a terminated string
+const char* paged_string(const PagedIndex* index, uint32_t offset) {
+    if (offset >= index->header->string_bytes) paged_index_corrupt("string offset out of range");
+    return index->strings + offset;
+}
+
+//Number of keys in the page that are <= key (upper == true) or < key
+int paged_search_keys(const PagedIndex* index, const PagedNode* node, const char* key, bool upper) {
+    const uint32_t* keys = (const uint32_t*)(node + 1);
+    int lo = 0, hi = (int)node->num_keys;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        int cmp = strcmp(paged_string(index, keys[mid]), key);
+        if (cmp < 0 || (upper && cmp == 0)) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+//Ranking of a department as a slice of the entry array, or NULL if absent
+const PagedValue* paged_find_department(const PagedIndex* index, const char* dept_name) {
+    const PagedNode* node = paged_node(index, index->header->root_page);
+    uint32_t order = index->header->order;
+    //A child id pointing back up would otherwise loop forever
+    for (uint32_t level = 1; !node->is_leaf; level++) {
+        if (level == index->header->height) paged_index_corrupt("tree deeper than its height");
+        const uint32_t* children = (const uint32_t*)(node + 1) + order - 1;
+        node = paged_node(index, children[paged_search_keys(index, node, dept_name, true)]);
+    }
+    int i = paged_search_keys(index, node, dept_name, false);
+    const uint32_t* keys = (const uint32_t*)(node + 1);
+    if (i >= (int)node->num_keys || strcmp(paged_string(index, keys[i]), dept_name) != 0) return NULL;
+    const PagedValue* value = (const PagedValue*)(keys + order - 1) + i;
+    if ((uint64_t)value->first_entry + value->count > index->header->entry_count) paged_index_corrupt("entry range past the entry array");
+    return value;
+}
+
+
+//Frozen Snapshot Functions
+
+//Compacts the loaded tree into frozen. The level-order walk is the one
+//save_index does, and strings are interned the same way.
+bool freeze_tree(FrozenTree* frozen) {
+    memset(frozen, 0, sizeof(FrozenTree));
+    if (root == NULL) { printf("Tree is empty. Nothing to freeze.\n"); return false; }
+    size_t node_capacity = 1024;
+    Node** nodes = (Node**)malloc(node_capacity * sizeof(Node*));
+    if (!nodes) { perror("Snapshot allocation failed"); return false; }
+    size_t node_count = 0, key_count = 0, entry_count = 0;
+    nodes[node_count++] = root;
+    for (size_t i = 0; i < node_count; i++) {
+        key_count += (size_t)nodes[i]->num_keys;
+        if (nodes[i]->is_leaf) {
+            frozen->leaf_count++;
+            frozen->department_count += (uint32_t)nodes[i]->num_keys;
+            for (int k = 0; k < nodes[i]->num_keys; k++) entry_count += (size_t)((RankList*)nodes[i]->pointers[k])->count;
+            continue;
+        }
+        for (int c = 0; c <= nodes[i]->num_keys; c++) {
+            if (node_count == node_capacity) {
+                node_capacity *= 2;
+                Node** grown = (Node**)realloc(nodes, node_capacity * sizeof(Node*));
+                if (!grown) { perror("Snapshot allocation failed"); free(nodes); return false; }
+                nodes = grown;
+            }
+            nodes[node_count++] = (Node*)nodes[i]->pointers[c];
+        }
+    }
+    frozen->height = (uint32_t)calculate_tree_height();
+    frozen->node_count = (uint32_t)node_count;
+    frozen->key_count = (uint32_t)key_count;
+    frozen->entry_count = (uint32_t)entry_count;
+    frozen->nodes = (FrozenNode*)malloc(node_count * sizeof(FrozenNode));
+    frozen->keys = (uint32_t*)malloc((key_count ? key_count : 1) * sizeof(uint32_t));
+    frozen->prefixes = (uint64_t*)malloc((key_count ? key_count : 1) * sizeof(uint64_t));
+    frozen->departments = (PagedValue*)malloc((frozen->department_count ? frozen->department_count : 1) * sizeof(PagedValue));
+    frozen->entries = (PagedEntry*)malloc((entry_count ? entry_count : 1) * sizeof(PagedEntry));
+    if (!frozen->nodes || !frozen->keys || !frozen->prefixes || !frozen->departments || !frozen->entries) {
+        perror("Snapshot allocation failed");
+        free(nodes);
+        frozen_tree_free(frozen);
+        return false;
+    }
+    IndexWriter pool; //Only its string pool is used
+    memset(&pool, 0, sizeof(IndexWriter));
+    uint32_t next_key = 0, next_child = 1, next_department = 0, next_entry = 0;
+    for (size_t i = 0; i < node_count; i++) {
+        Node* node = nodes[i];
+        FrozenNode* out = &frozen->nodes[i];
+        out->first_key = next_key;
+        out->num_keys = (uint16_t)node->num_keys;
+        out->prefix_len = 0;
+        if (node->num_keys > 1) {
+            const char* first = key_str(node->keys[0]);
+            const char* last = key_str(node->keys[node->num_keys - 1]);
+            while (first[out->prefix_len] != '\0' && first[out->prefix_len] == last[out->prefix_len]) out->prefix_len++;
+        }
+        for (int k = 0; k < node->num_keys; k++) {
+            frozen->keys[next_key] = index_intern(&pool, key_str(node->keys[k]));
+            frozen->prefixes[next_key] = key_prefix(key_str(node->keys[k]) + out->prefix_len);
+            next_key++;
+        }
+        if (!node->is_leaf) {
+            out->first_child = next_child;
+            next_child += (uint32_t)node->num_keys + 1;
+            continue;
+        }
+        out->first_child = next_department;
+        for (int k = 0; k < node->num_keys; k++) {
+            RankList* list = (RankList*)node->pointers[k];
+            frozen->departments[next_department].first_entry = next_entry;
+            frozen->departments[next_department].count = (uint32_t)list->count;
+            next_department++;
+            for (UniversityNode* u = rank_list_first(list); u != NULL; u = u->links[0].next) {
+                frozen->entries[next_entry].name_offset = index_intern(&pool, u->university_name);
+                frozen->entries[next_entry].score = u->score;
+                next_entry++;
+            }
+        }
+    }
+    //Trim the pool to its contents
+    frozen->string_bytes = pool.strings.used;
+    frozen->strings = (char*)realloc(pool.strings.data, pool.strings.used ? pool.strings.used : 1);
+    if (!frozen->strings) frozen->strings = pool.strings.data;
+    free(pool.slots);
+    free(nodes);
+    return true;
+}
+
+void frozen_tree_free(FrozenTree* frozen) {
+    free(frozen->nodes);
+    free(frozen->keys);
+    free(frozen->prefixes);
+    free(frozen->departments);
+    free(frozen->entries);
+    free(frozen->strings);
+    memset(frozen, 0, sizeof(FrozenTree));
+}
+
+size_t frozen_tree_bytes(const FrozenTree* frozen) {
+    return (size_t)frozen->node_count * sizeof(FrozenNode) +
+           (size_t)frozen->key_count * (sizeof(uint32_t) + sizeof(uint64_t)) +
+           (size_t)frozen->department_count * sizeof(PagedValue) +
+           (size_t)frozen->entry_count * sizeof(PagedEntry) +
+           frozen->string_bytes;
+}
+
+//node_upper_bound (upper) or node_lower_bound for a frozen node: keys outside
+//the shared prefix are settled by one strncmp, the rest by a binary search on
+//the fingerprints with strcmp only between equal ones
+int frozen_bound(const FrozenTree* frozen, const FrozenNode* node, const char* key, bool upper) {
+    const uint32_t* keys = frozen->keys + node->first_key;
+    const uint64_t* prefixes = frozen->prefixes + node->first_key;
+    int n = node->num_keys;
+    if (n == 0) return 0;
+    size_t shared = node->prefix_len;
+    int cmp = strncmp(key, frozen->strings + keys[0], shared);
+    if (cmp != 0) return cmp < 0 ? 0 : n;
+    uint64_t prefix = key_prefix(key + shared);
+    int lo = 0, hi = n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (prefixes[mid] != prefix) cmp = prefixes[mid] < prefix ? -1 : 1;
+        else cmp = strcmp(frozen->strings + keys[mid] + shared, key + shared);
+        if (cmp < 0 || (upper && cmp == 0)) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+//Ranking of a department in the snapshot as a slice of its entry array, or NULL
+const PagedValue* frozen_find_department(const FrozenTree* frozen, const char* dept_name) {
+    if (frozen->node_count == 0) return NULL;
+    const FrozenNode* node = &frozen->nodes[0];
+    for (uint32_t level = 1; level < frozen->height; level++) {
+        node = &frozen->nodes[node->first_child + frozen_bound(frozen, node, dept_name, true)];
+    }
+    int i = frozen_bound(frozen, node, dept_name, false);
+    if (i >= node->num_keys || strcmp(frozen->strings + frozen->keys[node->first_key + i], dept_name) != 0) return NULL;
+    return &frozen->departments[node->first_child + i];
+}
+
+//True when queries are answered by the mapped index or the frozen snapshot
+bool readonly_layout() {
+    return paged_index.base != NULL || frozen_tree.nodes != NULL;
+}
+
+//Department lookup in the read-only layout in use; entries and strings are
+//set to that layout's arrays
+const PagedValue* readonly_find_department(const char* dept_name, const PagedEntry** entries, const char** strings) {
+    if (paged_index.base) {
+        *entries = paged_index.entries;
+        *strings = paged_index.strings;
+        return paged_find_department(&paged_index, dept_name);
+    }
+    *entries = frozen_tree.entries;
+    *strings = frozen_tree.strings;
+    return frozen_find_department(&frozen_tree, dept_name);
+}
+
+//Entry name in the read-only layout in use; offsets from a mapped file are checked
+const char* readonly_string(const char* strings, uint32_t offset) {
+    if (paged_index.base) return paged_string(&paged_index, offset);
+    return strings + offset;
+}
+
+//Batch Query Functions
+
+//Parses "R<TAB>department<TAB>rank" or "U<TAB>department<TAB>university"
+bool parse_batch_query(char* line, BatchQuery* query) {
+    memset(query, 0, sizeof(BatchQuery));
+    line[strcspn(line, "\r\n")] = 0;
+    char* dept = strchr(line, '\t');
+    if (dept == NULL || dept - line != 1 || (line[0] != 'R' && line[0] != 'U')) return false;
+    char* arg = strchr(++dept, '\t');
+    if (arg == NULL) return false;
+    *arg++ = 0;
+    if (strlen(dept) >= MAX_LINE_LEN || strlen(arg) >= MAX_LINE_LEN) return false;
+    query->type = line[0];
+    strcpy(query->dept_name, dept);
+    if (query->type == 'R') {
+        char* end;
+        long rank = strtol(arg, &end, 10);
+        if (*end != 0 || rank < 1 || rank > INT32_MAX) return false;
+        query->rank = (int)rank;
+    } else {
+        strcpy(query->uni_name, arg);
+    }
+    return true;
+}
+
+int compare_batch_queries(const void* a, const void* b) {
+    const BatchQuery* q1 = *(const BatchQuery* const*)a;
+    const BatchQuery* q2 = *(const BatchQuery* const*)b;
+    int cmp = strcmp(q1->dept_name, q2->dept_name);
+    if (cmp != 0) return cmp;
+    return (q1 > q2) - (q1 < q2);
+}
+
+//Answers one query against a department's ranking
+void resolve_in_list(BatchQuery* query, const RankList* list) {
+    if (query->type == 'R') {
+        UniversityNode* uni = rank_list_at(list, query->rank);
+        if (uni != NULL) {
+            query->result_name = uni->university_name;
+            query->result_score = uni->score;
+            query->result_rank = query->rank;
+        }
+        return;
+    }
+    int rank = 1;
+    for (UniversityNode* uni = rank_list_first(list); uni != NULL; uni = uni->links[0].next, rank++) {
+        if (strcmp(uni->university_name, query->uni_name) == 0) {
+            query->result_name = uni->university_name;
+            query->result_score = uni->score;
+            query->result_rank = rank;
+            return;
+        }
+    }
+}
+
+//Same as resolve_in_list for a department of a read-only layout
+void resolve_in_paged(BatchQuery* query, const PagedValue* value, const PagedEntry* entries, const char* strings) {
+    for (uint32_t i = 0; i < value->count; i++) {
+        if (query->type == 'R' && (uint32_t)query->rank != i + 1) continue;
+        const PagedEntry* entry = &entries[value->first_entry + i];
+        const char* name = readonly_string(strings, entry->name_offset);
+        if (query->type == 'U' && strcmp(name, query->uni_name) != 0) continue;
+        query->result_name = name;
+        query->result_score = entry->score;
+        query->result_rank = (int)i + 1;
+        return;
+    }
+}
+
+//Resolves queries[0..count) in department order: one descent to the first
+//department, then forward along the leaf chain. A key more than
+//BATCH_MAX_LEAF_HOPS leaves ahead is reached by a fresh descent instead, so a
+//sparse batch never costs more than independent lookups. Results are stored
+//in the queries themselves, which keep their original order. With the hash
+//index every query is a direct lookup, so nothing is sorted.
+void resolve_batch(BatchQuery* queries, BatchQuery** sorted, int count) {
+    if (use_hash_index && !readonly_layout()) {
+        for (int i = 0; i < count; i++) {
+            RankList* list = queries[i].type != 0 ? dept_hash_find(queries[i].dept_name) : NULL;
+            if (list != NULL) resolve_in_list(&queries[i], list);
+        }
+        return;
+    }
+    for (int i = 0; i < count; i++) sorted[i] = &queries[i];
+    qsort(sorted, (size_t)count, sizeof(BatchQuery*), compare_batch_queries);
+    Node* leaf = NULL;
+    int pos = 0;
+    for (int i = 0; i < count; i++) {
+        BatchQuery* query = sorted[i];
+        if (query->type == 0) continue;
+        if (readonly_layout()) {
+            const PagedEntry* entries;
+            const char* strings;
+            const PagedValue* value = readonly_find_department(query->dept_name, &entries, &strings);
+            if (value != NULL) resolve_in_paged(query, value, entries, strings);
+            continue;
+        }
+        if (leaf == NULL) {
+            leaf = find_leaf(root, query->dept_name);
+            batch_descents++;
+            pos = 0;
+        }
+        int hops = 0;
+        while (leaf != NULL && (leaf->num_keys == 0 || strcmp(key_str(leaf->keys[leaf->num_keys - 1]), query->dept_name) < 0)) {
+            if (hops == BATCH_MAX_LEAF_HOPS) {
+                leaf = find_leaf(root, query->dept_name);
+                batch_descents++;
+                pos = 0;
+                break;
+            }
+            leaf = leaf->next;
+            batch_leaf_hops++;
+            hops++;
+            pos = 0;
+        }
+        if (leaf == NULL) break; //Every remaining key is past the last leaf
+        while (pos < leaf->num_keys && strcmp(key_str(leaf->keys[pos]), query->dept_name) < 0) pos++;
+        if (pos < leaf->num_keys && strcmp(key_str(leaf->keys[pos]), query->dept_name) == 0) {
+            resolve_in_list(query, (RankList*)leaf->pointers[pos]);
+        }
+    }
+}
+
+//Reads queries from in, one per line, and writes one answer line per query
+//in input order: "rank<TAB>university<TAB>score", or "-" when there is none.
+void run_batch_queries(FILE* in, FILE* out, int batch_size) {
+    BatchQuery* queries = (BatchQuery*)malloc((size_t)batch_size * sizeof(BatchQuery));
+    BatchQuery** sorted = (BatchQuery**)malloc((size_t)batch_size * sizeof(BatchQuery*));
+    if (!queries || !sorted) { perror("Batch allocation failed"); exit(1); }
+    char line[3 * MAX_LINE_LEN];
+    long total = 0, batches = 0;
+    batch_descents = 0;
+    batch_leaf_hops = 0;
+    double start = wall_clock_seconds();
+    bool more = true;
+    while (more) {
+        int count = 0;
+        while (count < batch_size) {
+            if (fgets(line, sizeof(line), in) == NULL) { more = false; break; }
+            if (line[0] == '\n' || line[0] == 0) continue;
+            if (!parse_batch_query(line, &queries[count])) fprintf(stderr, "Malformed query on line %ld\n", total + count + 1);
+            count++;
+        }
+        if (count == 0) break;
+        resolve_batch(queries, sorted, count);
+        for (int i = 0; i < count; i++) {
+            if (queries[i].result_name != NULL) {
+                fprintf(out, "%d\t%s\t%.2f\n", queries[i].result_rank, queries[i].result_name, queries[i].result_score);
+            } else {
+                fputs("-\n", out);
+            }
+        }
+        total += count;
+        batches++;
+    }
+    fflush(out);
+    fprintf(stderr, "Answered %ld queries in %ld batches (%lld descents, %lld leaf hops) in %.4f sec.\n",
+            total, batches, batch_descents, batch_leaf_hops, wall_clock_seconds() - start);
+    free(queries);
+    free(sorted);
+}
+
+//Scan Functions
+
+//Positions the iterator on the first department >= from. Nothing is read
+//until scan_next, and departments are produced one leaf slot at a time.
+void scan_seek(ScanIterator* it, const char* from, int limit) {
+    memset(it, 0, sizeof(ScanIterator));
+    it->limit = limit;
+    it->leaf = find_leaf(root, from);
+    if (it->leaf != NULL) it->pos = node_lower_bound(it->leaf, from);
+}
+
+//Departments in [from, to], both inclusive
+void scan_begin_range(ScanIterator* it, const char* from, const char* to, int limit) {
+    scan_seek(it, from, limit);
+    it->to = to;
+}
+
+//Departments whose name starts with prefix
+void scan_begin_prefix(ScanIterator* it, const char* prefix, int limit) {
+    scan_seek(it, prefix, limit);
+    it->prefix = prefix;
+    it->prefix_len = strlen(prefix);
+}
+
+//Advances to the next department in the scan. Returns false once the keys
+//leave the range or the leaf chain ends.
+bool scan_next(ScanIterator* it) {
+    while (it->leaf != NULL && it->pos >= it->leaf->num_keys) {
+        it->leaf = it->leaf->next;
+        it->pos = 0;
+    }
+    if (it->leaf == NULL) return false;
+    const char* key = key_str(it->leaf->keys[it->pos]);
+    if ((it->to != NULL && strcmp(key, it->to) > 0) ||
+        (it->prefix != NULL && strncmp(key, it->prefix, it->prefix_len) != 0)) {
+        it->leaf = NULL;
+        return false;
+    }
+    it->dept_name = key;
+    it->list = (RankList*)it->leaf->pointers[it->pos];
+    it->current = NULL;
+    it->rank = 0;
+    it->pos++;
+    return true;
+}
+
+//Next university of the current department in rank order, stopping after
+//limit entries when a limit was given
+UniversityNode* scan_next_university(ScanIterator* it) {
+    if (it->list == NULL || (it->limit > 0 && it->rank >= it->limit)) return NULL;
+    it->current = it->rank == 0 ? rank_list_first(it->list) : it->current->links[0].next;
+    if (it->current != NULL) it->rank++;
+    return it->current;
+}
+
+//Streams a scan to out: a department line followed by its (top-k) ranking
+void print_scan(ScanIterator* it, FILE* out) {
+    long departments = 0;
+    while (scan_next(it)) {
+        fprintf(out, "%s (%d universities)\n", it->dept_name, it->list->count);
+        for (UniversityNode* uni = scan_next_university(it); uni != NULL; uni = scan_next_university(it)) {
+            fprintf(out, "  %d\t%s\t%.2f\n", it->rank, uni->university_name, uni->score);
+        }
+        departments++;
+    }
+    fprintf(out, "%ld departments.\n", departments);
+}
+
+//University Index Functions
+
+UniEntry* uni_index_find(const char* uni_name) {
+    if (uni_index.count == 0) return NULL;
+    uint32_t hash = hash_key(uni_name);
+    size_t mask = uni_index.capacity - 1;
+    for (size_t i = hash & mask; uni_index.slots[i].programs != NULL; i = (i + 1) & mask) {
+        if (uni_index.slots[i].hash == hash && strcmp(key_str(uni_index.slots[i].name), uni_name) == 0) {
+            return &uni_index.slots[i];
+        }
+    }
+    return NULL;
+}
+
+//Slot for a university, created on first use; the table doubles past a 0.7 load factor
+UniEntry* uni_index_entry(const char* uni_name) {
+    UniEntry* entry = uni_index_find(uni_name);
+    if (entry != NULL) return entry;
+    if ((uni_index.count + 1) * 10 > uni_index.capacity * 7) {
+        size_t new_capacity = uni_index.capacity ? uni_index.capacity * 2 : 256;
+        UniEntry* slots = (UniEntry*)calloc(new_capacity, sizeof(UniEntry));
+        if (!slots) { perror("University index allocation failed"); exit(1); }
+        for (size_t i = 0; i < uni_index.capacity; i++) {
+            if (uni_index.slots[i].programs == NULL) continue;
+            size_t j = uni_index.slots[i].hash & (new_capacity - 1);
+            while (slots[j].programs != NULL) j = (j + 1) & (new_capacity - 1);
+            slots[j] = uni_index.slots[i];
+        }
+        free(uni_index.slots);
+        uni_index.slots = slots;
+        uni_index.capacity = new_capacity;
+    }
+    uint32_t hash = hash_key(uni_name);
+    size_t i = hash & (uni_index.capacity - 1);
+    while (uni_index.slots[i].programs != NULL) i = (i + 1) & (uni_index.capacity - 1);
+    entry = &uni_index.slots[i];
+    entry->hash = hash;
+    entry->name = key_store_add(uni_name);
+    entry->capacity = 4;
+    entry->programs = (UniProgram*)malloc((size_t)entry->capacity * sizeof(UniProgram));
+    if (!entry->programs) { perror("University index allocation failed"); exit(1); }
+    uni_index.program_bytes += (size_t)entry->capacity * sizeof(UniProgram);
+    uni_index.count++;
+    return entry;
+}
+
+//Index of the first program of the university whose department handle is > dept
+//(>= when lower is set)
+int uni_programs_bound(const UniEntry* entry, KeyRef dept, bool lower) {
+    int lo = 0, hi = entry->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        KeyRef key = entry->programs[mid].dept;
+        if (key < dept || (!lower && key == dept)) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+//Records that uni now appears in list. The bulk loader interns departments in
+//order, so there every add is an append.
+void uni_index_add(UniversityNode* uni, RankList* list) {
+    if (!use_university_index) return;
+    UniEntry* entry = uni_index_entry(uni->university_name);
+    int pos = entry->count;
+    if (pos > 0 && entry->programs[pos - 1].dept > list->key) pos = uni_programs_bound(entry, list->key, false);
+    if (entry->count == entry->capacity) {
+        UniProgram* programs = (UniProgram*)realloc(entry->programs, (size_t)entry->capacity * 2 * sizeof(UniProgram));
+        if (!programs) { perror("University index allocation failed"); exit(1); }
+        uni_index.program_bytes += (size_t)entry->capacity * sizeof(UniProgram);
+        entry->programs = programs;
+        entry->capacity *= 2;
+    }
+    memmove(&entry->programs[pos + 1], &entry->programs[pos], (size_t)(entry->count - pos) * sizeof(UniProgram));
+    entry->programs[pos].dept = list->key;
+    entry->programs[pos].list = list;
+    entry->programs[pos].uni = uni;
+    entry->count++;
+}
+
+//Emptied universities keep their slot, so no probe run has to be repaired
+void uni_index_remove(const UniversityNode* uni, const RankList* list) {
+    UniEntry* entry = uni_index_find(uni->university_name);
+    if (entry == NULL) return;
+    int i = uni_programs_bound(entry, list->key, true);
+    while (i < entry->count && entry->programs[i].dept == list->key && entry->programs[i].uni != uni) i++;
+    if (i == entry->count || entry->programs[i].uni != uni) return;
+    memmove(&entry->programs[i], &entry->programs[i + 1], (size_t)(entry->count - i - 1) * sizeof(UniProgram));
+    entry->count--;
+}
+
+void uni_index_free() {
+    for (size_t i = 0; i < uni_index.capacity; i++) free(uni_index.slots[i].programs);
+    free(uni_index.slots);
+    memset(&uni_index, 0, sizeof(UniIndex));
+}
+
+int compare_programs_by_name(const void* a, const void* b) {
+    const UniProgram* p1 = (const UniProgram*)a;
+    const UniProgram* p2 = (const UniProgram*)b;
+    int cmp = strcmp(key_str(p1->dept), key_str(p2->dept));
+    if (cmp != 0) return cmp;
+    return (p1->uni->score < p2->uni->score) - (p1->uni->score > p2->uni->score);
+}
+
+//Prints every program of a university by department name, or only those in
+//dept_name when it is given
+void print_university_programs(const char* uni_name, const char* dept_name, FILE* out) {
+    UniEntry* entry = uni_index_find(uni_name);
+    int first = 0, last = entry != NULL ? entry->count : 0;
+    if (entry != NULL && dept_name != NULL) {
+        RankList* list = find_department(dept_name);
+        first = list != NULL ? uni_programs_bound(entry, list->key, true) : 0;
+        last = list != NULL ? uni_programs_bound(entry, list->key, false) : 0;
+    }
+    UniProgram* programs = NULL;
+    if (last > first) {
+        programs = (UniProgram*)malloc((size_t)(last - first) * sizeof(UniProgram));
+        if (!programs) { perror("University index allocation failed"); exit(1); }
+        memcpy(programs, &entry->programs[first], (size_t)(last - first) * sizeof(UniProgram));
+        qsort(programs, (size_t)(last - first), sizeof(UniProgram), compare_programs_by_name);
+    }
+    for (int i = 0; i < last - first; i++) {
+        fprintf(out, "%s\t%.2f\n", key_str(programs[i].dept), programs[i].uni->score);
+    }
+    fprintf(out, "%d programs.\n", last - first);
+    free(programs);
+}
+
+//Score Index Functions
+
+//Score index order: score descending, then department and university name.
+//Full duplicates compare equal and keep insertion order.
+int compare_program_scores(const UniversityNode* a, const RankList* a_list, const UniversityNode* b, const RankList* b_list) {
+    if (a->score != b->score) return a->score > b->score ? -1 : 1;
+    if (a_list != b_list) {
+        int cmp = strcmp(key_str(a_list->key), key_str(b_list->key));
+        if (cmp != 0) return cmp;
+    }
+    return strcmp(a->university_name, b->university_name);
+}
+
+//Carved from uni_arena; --no-arena falls back to one malloc per node
+ScoreNode* create_score_node(UniversityNode* uni, RankList* list, int level) {
+    size_t bytes = sizeof(ScoreNode) + (size_t)level * sizeof(ScoreNode*);
+    ScoreNode* node = use_arena ? (ScoreNode*)arena_alloc(&uni_arena, bytes, sizeof(void*))
+                                : (ScoreNode*)malloc(bytes);
+    if (!node) { perror("Score index allocation failed"); exit(1); }
+    node->uni = uni;
+    node->list = list;
+    node->level = level;
+    memset(node->next, 0, (size_t)level * sizeof(ScoreNode*));
+    score_index.bytes += bytes;
+    score_index.count++;
+    return node;
+}
+
+//Links a new program into the score index; O(log n) expected like the rankings
+void score_index_insert(UniversityNode* uni, RankList* list) {
+    if (!use_score_index) return;
+    score_index_link(create_score_node(uni, list, random_skip_level()));
+}
+
+//Links node after every entry that does not rank behind it
+void score_index_link(ScoreNode* node) {
+    ScoreNode** update[SKIP_MAX_LEVEL];
+    ScoreNode** x = score_index.head;
+    for (int l = score_index.level - 1; l >= 0; l--) {
+        while (x[l] != NULL && compare_program_scores(x[l]->uni, x[l]->list, node->uni, node->list) <= 0) x = x[l]->next;
+        update[l] = x;
+    }
+    for (int l = score_index.level; l < node->level; l++) update[l] = score_index.head;
+    if (node->level > score_index.level) score_index.level = node->level;
+    for (int l = 0; l < node->level; l++) {
+        node->next[l] = update[l][l];
+        update[l][l] = node;
+    }
+}
+
+int compare_score_entries(const void* a, const void* b) {
+    const ScoreEntry* e1 = (const ScoreEntry*)a;
+    const ScoreEntry* e2 = (const ScoreEntry*)b;
+    int cmp = compare_program_scores(e1->uni, e1->list, e2->uni, e2->list);
+    if (cmp != 0) return cmp;
+    return (e1->position > e2->position) - (e1->position < e2->position);
+}
+
+//Unlinks the entry of uni from the score index and returns it for relinking, or
+//NULL when the index is off. Equal entries may sit on either side of it, so each
+//level stops before them and then steps forward to the node itself.
+ScoreNode* score_index_unlink(const UniversityNode* uni, const RankList* list) {
+    if (score_index.count == 0) return NULL;
+    ScoreNode** update[SKIP_MAX_LEVEL];
+    ScoreNode** x = score_index.head;
+    for (int l = score_index.level - 1; l >= 0; l--) {
+        while (x[l] != NULL && compare_program_scores(x[l]->uni, x[l]->list, uni, list) < 0) x = x[l]->next;
+        update[l] = x;
+    }
+    ScoreNode** y = update[0];
+    while (y[0] != NULL && y[0]->uni != uni) y = y[0]->next;
+    ScoreNode* node = y[0];
+    if (node == NULL) return NULL;
+    for (int l = 0; l < node->level; l++) {
+        while (update[l][l] != node) update[l] = update[l][l]->next;
+        update[l][l] = node->next[l];
+    }
+    while (score_index.level > 0 && score_index.head[score_index.level - 1] == NULL) score_index.level--;
+    return node;
+}
+
+//Bulk counterpart of score_index_insert: the loaded programs are gathered along
+//the leaf chain (department and rank order, so load order breaks full ties as
+//the sequential path does), sorted score-first and appended with the balanced
+//levels rank_list_append uses
+void score_index_build() {
+    if (!use_score_index) return;
+    long count = 0;
+    for (Node* leaf = first_leaf; leaf != NULL; leaf = leaf->next) {
+        for (int i = 0; i < leaf->num_keys; i++) count += ((RankList*)leaf->pointers[i])->count;
+    }
+    if (count == 0) return;
+    ScoreEntry* entries = (ScoreEntry*)malloc((size_t)count * sizeof(ScoreEntry));
+    if (!entries) { perror("Score index allocation failed"); exit(1); }
+    long n = 0;
+    for (Node* leaf = first_leaf; leaf != NULL; leaf = leaf->next) {
+        for (int i = 0; i < leaf->num_keys; i++) {
+            RankList* list = (RankList*)leaf->pointers[i];
+            for (UniversityNode* uni = rank_list_first(list); uni != NULL; uni = uni->links[0].next, n++) {
+                entries[n].uni = uni;
+                entries[n].list = list;
+                entries[n].position = n;
+            }
+        }
+    }
+    qsort(entries, (size_t)count, sizeof(ScoreEntry), compare_score_entries);
+    ScoreNode** last[SKIP_MAX_LEVEL];
+    for (int l = 0; l < SKIP_MAX_LEVEL; l++) last[l] = score_index.head;
+    for (long i = 0; i < count; i++) {
+        int level = 1;
+        for (long r = i + 1; (r & 3) == 0 && level < SKIP_MAX_LEVEL; r >>= 2) level++;
+        ScoreNode* node = create_score_node(entries[i].uni, entries[i].list, level);
+        for (int l = 0; l < level; l++) {
+            last[l][l] = node;
+            last[l] = node->next;
+        }
+        if (level > score_index.level) score_index.level = level;
+    }
+    free(entries);
+}
+
+//Unlinks the program's score node and releases it
+void score_index_remove(const UniversityNode* uni, const RankList* list) {
+    ScoreNode* node = score_index_unlink(uni, list);
+    if (node == NULL) return;
+    score_index.bytes -= sizeof(ScoreNode) + (size_t)node->level * sizeof(ScoreNode*);
+    score_index.count--;
+    if (!use_arena) free(node);
+}
+
+//First program whose score is <= max_score, NULL when there is none
+ScoreNode* score_index_seek(float max_score) {
+    ScoreNode** x = score_index.head;
+    for (int l = score_index.level - 1; l >= 0; l--) {
+        while (x[l] != NULL && x[l]->uni->score > max_score) x = x[l]->next;
+    }
+    return x[0];
+}
+
+void score_index_free() {
+    if (!use_arena) {
+        ScoreNode* node = score_index.head[0];
+        while (node != NULL) { ScoreNode* tmp = node; node = node->next[0]; free(tmp); }
+    }
+    memset(&score_index, 0, sizeof(ScoreIndex));
+}
+
+//Prints the programs scoring within [min_score, max_score], best first, at
+//most limit of them when limit > 0
+void print_score_range(float min_score, float max_score, long limit, FILE* out) {
+    long printed = 0;
+    for (ScoreNode* node = score_index_seek(max_score); node != NULL && node->uni->score >= min_score; node = node->next[0]) {
+        if (limit > 0 && printed == limit) break;
+        fprintf(out, "%.2f\t%s\t%s\n", node->uni->score, node->uni->university_name, key_str(node->list->key));
+        printed++;
+    }
+    fprintf(out, "%ld programs.\n", printed);
+}
+
+//Rank Cache Functions
+
+//Probing updates CLOCK bits and fills replace entries, so queries running
+//concurrently under the shared read lock go straight to the tree instead
+bool rank_cache_enabled() {
+    return rank_cache_size > 0 && !concurrent_mode;
+}
+
+uint32_t rank_cache_set(uint32_t hash, int rank) {
+    return (hash ^ (uint32_t)rank * 2654435761u) & (uint32_t)(rank_cache.set_count - 1);
+}
+
+//Valid entry for the query, or NULL. An entry read from an older version of
+//its ranking is dropped here, so an insert or delta only invalidates the
+//entries of the department it changed.
+RankCacheEntry* rank_cache_probe(uint32_t hash, const char* dept_name, int rank) {
+    if (rank_cache.entries == NULL) {
+        rank_cache.misses++;
+        return NULL;
+    }
+    RankCacheEntry* set = &rank_cache.entries[(size_t)rank_cache_set(hash, rank) * RANK_CACHE_WAYS];
+    for (int w = 0; w < RANK_CACHE_WAYS; w++) {
+        RankCacheEntry* entry = &set[w];
+        if (entry->list == NULL || entry->hash != hash || entry->rank != rank ||
+            strcmp(key_str(entry->list->key), dept_name) != 0) continue;
+        if (entry->version != entry->list->version) {
+            entry->list = NULL;
+            rank_cache.invalidations++;
             break;
         }
-        char id[MAX_LINE_LEN];
-        sscanf(line, "%[^,],%[^,],%[^,],%f", id, primary_heap[i].uni_name, primary_heap[i].dept_name, &primary_heap[i].score);
-        current_heap_size++;
-    }
-    while (current_heap_size > 0) {
-        char out_fname[20];
-        sprintf(out_fname, "run_%d.tmp", run_count);
-        FILE* out = fopen(out_fname, "w");
-        if (!out) { perror("Could not open temp file"); free(primary_heap); free(secondary_storage); fclose(in); return -1; }
-        for (int i = (current_heap_size / 2) - 1; i >= 0; i--) {
-            min_heapify_replacement(primary_heap, current_heap_size, i);
-        }
-        int secondary_count = 0;
-        while (current_heap_size > 0) {
-            Record min_record = primary_heap[0];
-            fprintf(out, "%s,%s,%f\n", min_record.uni_name, min_record.dept_name, min_record.score);
-            Record new_record;
-            bool got_new_record = false;
-            if (more_input) {
-                if (fgets(line, sizeof(line), in)) {
-                    char id[MAX_LINE_LEN];
-                    sscanf(line, "%[^,],%[^,],%[^,],%f", id, new_record.uni_name, new_record.dept_name, &new_record.score);
-                    got_new_record = true;
-                } else { more_input = false; }
-            }
-            if (got_new_record) {
-                if (compare_records(&new_record, &min_record) >= 0) {
-                    primary_heap[0] = new_record;
-                } else {
-                    if (secondary_count < SECONDARY_STORAGE_SIZE) {
-                        secondary_storage[secondary_count++] = new_record;
-                    }
-                    primary_heap[0] = primary_heap[current_heap_size - 1];
-                    current_heap_size--;
-                }
-            } else {
-                primary_heap[0] = primary_heap[current_heap_size - 1];
-                current_heap_size--;
-            }
-            if (current_heap_size > 0) {
-                min_heapify_replacement(primary_heap, current_heap_size, 0);
-            }
+        entry->referenced = true;
+        rank_cache.hits++;
+        return entry;
+    }
+    rank_cache.misses++;
+    return NULL;
+}
+
+//Stores an answer read from list, allocating the cache on first use. A full set
+//evicts the first entry its CLOCK hand finds without a second chance.
+void rank_cache_fill(uint32_t hash, RankList* list, int rank, UniversityNode* uni) {
+    if (rank_cache.entries == NULL) {
+        size_t sets = 1;
+        while (sets * RANK_CACHE_WAYS < rank_cache_size) sets *= 2;
+        rank_cache.entries = (RankCacheEntry*)calloc(sets * RANK_CACHE_WAYS, sizeof(RankCacheEntry));
+        rank_cache.hands = (uint8_t*)calloc(sets, 1);
+        if (!rank_cache.entries || !rank_cache.hands) { perror("Rank cache allocation failed"); exit(1); }
+        rank_cache.set_count = sets;
+    }
+    uint32_t s = rank_cache_set(hash, rank);
+    RankCacheEntry* set = &rank_cache.entries[(size_t)s * RANK_CACHE_WAYS];
+    RankCacheEntry* slot = NULL;
+    for (int w = 0; w < RANK_CACHE_WAYS && slot == NULL; w++) {
+        if (set[w].list == NULL) slot = &set[w];
+    }
+    while (slot == NULL) {
+        RankCacheEntry* candidate = &set[rank_cache.hands[s]];
+        rank_cache.hands[s] = (uint8_t)((rank_cache.hands[s] + 1) % RANK_CACHE_WAYS);
+        if (candidate->referenced) {
+            candidate->referenced = false;
+        } else {
+            slot = candidate;
+            rank_cache.evictions++;
+        }
+    }
+    slot->list = list;
+    slot->uni = uni;
+    slot->hash = hash;
+    slot->version = list->version;
+    slot->rank = rank;
+    slot->referenced = false;
+}
+
+//Drops the entries of a ranking that is about to be freed. Versions cannot
+//expire them: the ranking goes away, and its memory may be reused.
+void rank_cache_forget(const RankList* list) {
+    for (size_t i = 0; i < rank_cache.set_count * RANK_CACHE_WAYS; i++) {
+        if (rank_cache.entries[i].list == list) rank_cache.entries[i].list = NULL;
+    }
+}
+
+//Drops every entry with the rankings they point to; the counters are kept
+void rank_cache_free() {
+    free(rank_cache.entries);
+    free(rank_cache.hands);
+    rank_cache.entries = NULL;
+    rank_cache.hands = NULL;
+    rank_cache.set_count = 0;
+}
+
+//Rank-th university of a department, through the cache if cached is set.
+//department_found, when given, tells a missing department apart from a rank
+//past its end. Unknown departments are not cached: they have no ranking whose
+//version could expire.
+UniversityNode* lookup_rank(const char* dept_name, int rank, bool cached, bool* department_found) {
+    uint32_t hash = 0;
+    if (cached) {
+        hash = hash_key(dept_name);
+        RankCacheEntry* entry = rank_cache_probe(hash, dept_name, rank);
+        if (entry != NULL) {
+            if (department_found) *department_found = true;
+            return entry->uni;
+        }
+    }
+    RankList* list = find_department(dept_name);
+    if (department_found) *department_found = list != NULL;
+    if (list == NULL) return NULL;
+    UniversityNode* uni = rank_list_at(list, rank);
+    if (cached) rank_cache_fill(hash, list, rank, uni);
+    return uni;
+}
+
+#ifdef INSTRUMENT
+//Instrumentation Functions
+
+//Zeroes the counters and starts the hardware counters that perf_event_open
+//grants; the ones it refuses (no PMU, perf_event_paranoid) stay at -1.
+//inherit folds in the sort and query threads once they have exited.
+void instrument_begin() {
+    static const uint64_t configs[HW_EVENTS] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                               PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+    memset(&instrument, 0, sizeof(Instrumentation));
+    for (int e = 0; e < HW_EVENTS; e++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[e];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.inherit = 1;
+        hw_fds[e] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+}
+
+void instrument_snapshot(Instrumentation* out) {
+    *out = instrument;
+    for (int e = 0; e < HW_EVENTS; e++) {
+        uint64_t value = 0;
+        if (hw_fds[e] >= 0 && read(hw_fds[e], &value, sizeof(value)) != (ssize_t)sizeof(value)) value = 0;
+        out->hw[e] = value;
+    }
+}
+
+//One phase of the report: a JSON object, or phase,counter,value CSV rows
+void write_report_phase(FILE* out, bool json, const char* phase, const Instrumentation* counts) {
+    static const char* sort_names[SORT_PHASES] = {"run_generation", "merge_passes", "final_merge"};
+    const char* names[] = {"find_leaf_calls", "nodes_visited", "key_comparisons", "prefix_searches", "rank_queries", "list_hops"};
+    uint64_t values[] = {counts->find_leaf_calls, counts->nodes_visited, counts->key_comparisons,
+                         counts->prefix_searches, counts->rank_queries, counts->list_hops};
+    double per_find_leaf = counts->find_leaf_calls ? (double)counts->nodes_visited / counts->find_leaf_calls : 0.0;
+    double per_rank_query = counts->rank_queries ? (double)counts->list_hops / counts->rank_queries : 0.0;
+    if (!json) {
+        for (int i = 0; i < 6; i++) fprintf(out, "%s,%s,%llu\n", phase, names[i], (unsigned long long)values[i]);
+        fprintf(out, "%s,nodes_per_find_leaf,%.4f\n%s,hops_per_rank_query,%.4f\n", phase, per_find_leaf, phase, per_rank_query);
+        for (int p = 0; p < SORT_PHASES; p++) {
+            fprintf(out, "%s,sort_%s_bytes_read,%llu\n", phase, sort_names[p], (unsigned long long)counts->sort_bytes_read[p]);
+            fprintf(out, "%s,sort_%s_bytes_written,%llu\n", phase, sort_names[p], (unsigned long long)counts->sort_bytes_written[p]);
+        }
+        for (int e = 0; e < HW_EVENTS; e++) {
+            if (hw_fds[e] >= 0) fprintf(out, "%s,%s,%llu\n", phase, hw_names[e], (unsigned long long)counts->hw[e]);
+        }
+        return;
+    }
+    fprintf(out, "    \"%s\": {\n", phase);
+    for (int i = 0; i < 6; i++) fprintf(out, "      \"%s\": %llu,\n", names[i], (unsigned long long)values[i]);
+    fprintf(out, "      \"nodes_per_find_leaf\": %.4f,\n      \"hops_per_rank_query\": %.4f,\n", per_find_leaf, per_rank_query);
+    fprintf(out, "      \"sort\": {");
+    for (int p = 0; p < SORT_PHASES; p++) {
+        fprintf(out, "%s\"%s\": {\"bytes_read\": %llu, \"bytes_written\": %llu}", p ? ", " : "", sort_names[p],
+                (unsigned long long)counts->sort_bytes_read[p], (unsigned long long)counts->sort_bytes_written[p]);
+    }
+    fprintf(out, "},\n      \"hardware\": {");
+    for (int e = 0; e < HW_EVENTS; e++) {
+        if (hw_fds[e] >= 0) fprintf(out, "%s\"%s\": %llu", e ? ", " : "", hw_names[e], (unsigned long long)counts->hw[e]);
+        else fprintf(out, "%s\"%s\": null", e ? ", " : "", hw_names[e]);
+    }
+    fprintf(out, "}\n    }");
+}
+
+//Writes the load phase (up to instrument_load) and the query phase (since
+//then) as JSON, or as CSV when the file name ends in .csv
+bool write_report(const char* filename, const char* load_name) {
+    Instrumentation now, queries;
+    instrument_snapshot(&now);
+    queries = now;
+    uint64_t* total = (uint64_t*)&queries;
+    const uint64_t* load = (const uint64_t*)&instrument_load;
+    for (size_t i = 0; i < sizeof(Instrumentation) / sizeof(uint64_t); i++) total[i] -= load[i];
+    size_t len = strlen(filename);
+    bool json = !(len >= 4 && strcmp(filename + len - 4, ".csv") == 0);
+    FILE* out = fopen(filename, "w");
+    if (out == NULL) { perror("Could not open report file"); return false; }
+    if (json) {
+        fprintf(out, "{\n  \"input\": \"%s\",\n  \"load\": \"%s\",\n  \"order\": %d,\n  \"phases\": {\n", input_file, load_name, tree_order);
+        write_report_phase(out, true, "load", &instrument_load);
+        fprintf(out, ",\n");
+        write_report_phase(out, true, "queries", &queries);
+        fprintf(out, "\n  }\n}\n");
+    } else {
+        fprintf(out, "phase,counter,value\n");
+        write_report_phase(out, false, "load", &instrument_load);
+        write_report_phase(out, false, "queries", &queries);
+    }
+    if (fclose(out) != 0) { perror("Could not write report file"); return false; }
+    return true;
+}
+#endif
+
+//Delta Merge Functions
+
+//Applies a CSV of new and changed rows to the loaded tree. The delta is sorted
+//with the external sort used for bulk loading and merged in department order:
+//each affected leaf is reached by one descent, existing rankings are updated in
+//place, and new departments are merged into their leaf, which splits into as
+//many leaves as needed. Only the parents of new leaves change, so the cost
+//follows the size of the delta rather than the tree.
+bool apply_delta(const char* filename) {
+    double start = wall_clock_seconds();
+    //The sort statistics in the metrics describe the initial build
+    int saved_threads = run_generation_threads, saved_passes = merge_passes;
+    double saved_generation = run_generation_seconds;
+    int num_runs = create_sorted_runs_replacement_selection(filename, sort_threads);
+    if (num_runs < 0) { printf("Error: Could not create sorted runs.\n"); return false; }
+    int first_run = 0;
+    if (num_runs > 0) num_runs = merge_runs_multipass(&first_run, num_runs, merge_fan_in());
+    RunMerger merger;
+    bool ok = num_runs >= 0;
+    if (num_runs > 0) {
+        ok = merge_runs_begin(&merger, first_run, num_runs);
+        if (ok) {
+            tree_write_lock();
+            merge_delta_runs(&merger);
+            tree_write_unlock();
+            ok = !merger.failed;
+            merge_runs_end(&merger);
+        }
+    }
+    for (int i = first_run; i < first_run + num_runs; i++) {
+        char fname[32];
+        run_file_name(fname, i);
+        remove(fname);
+    }
+    run_generation_threads = saved_threads;
+    merge_passes = saved_passes;
+    run_generation_seconds = saved_generation;
+    delta_stats.seconds += wall_clock_seconds() - start;
+    if (!ok) printf("Error: Could not merge the sorted delta; departments before the failure were applied.\n");
+    return ok;
+}
+
+//Splits the sorted delta into departments and applies them in order
+void merge_delta_runs(RunMerger* merger) {
+    DeltaCursor cursor;
+    memset(&cursor, 0, sizeof(DeltaCursor));
+    int capacity = 64, count = 0;
+    Record* group = (Record*)malloc((size_t)capacity * sizeof(Record));
+    if (!group) { perror("Memory allocation error"); exit(1); }
+    char dept_name[MAX_LINE_LEN];
+    Record record;
+    bool more = merge_runs_next(merger, &record);
+    while (more) {
+        strcpy(dept_name, record.dept_name);
+        count = 0;
+        while (more && strcmp(record.dept_name, dept_name) == 0) {
+            if (count == capacity) {
+                capacity *= 2;
+                group = (Record*)realloc(group, (size_t)capacity * sizeof(Record));
+                if (!group) { perror("Memory allocation error"); exit(1); }
+            }
+            group[count++] = record;
+            more = merge_runs_next(merger, &record);
+        }
+        delta_apply_department(&cursor, dept_name, group, count);
+    }
+    delta_flush_leaf(&cursor);
+    free(group);
+    free(cursor.pending);
+}
+
+//University ascending, later rows first, so the last row of a repeated
+//(department, university) pair is the one applied
+int compare_delta_records(const void* a, const void* b) {
+    const Record* rec1 = (const Record*)a;
+    const Record* rec2 = (const Record*)b;
+    int cmp = strcmp(rec1->uni_name, rec2->uni_name);
+    if (cmp != 0) return cmp;
+    return (rec1->position < rec2->position) - (rec1->position > rec2->position);
+}
+
+void delta_apply_department(DeltaCursor* cursor, const char* dept_name, Record* group, int count) {
+    if (root == NULL) {
+        root = create_node(true);
+        first_leaf = root;
+    }
+    if (cursor->leaf == NULL || (cursor->bounded && strcmp(dept_name, key_str(cursor->upper)) >= 0)) {
+        delta_flush_leaf(cursor);
+        cursor->leaf = find_leaf_bounded(dept_name, &cursor->upper, &cursor->bounded);
+        delta_stats.leaves_touched++;
+    }
+    Node* leaf = cursor->leaf;
+    int i = node_lower_bound(leaf, dept_name);
+    RankList* list = NULL;
+    if (i < leaf->num_keys && strcmp(key_str(leaf->keys[i]), dept_name) == 0) {
+        list = (RankList*)leaf->pointers[i];
+    } else {
+        list = create_rank_list();
+        list->key = key_store_add(dept_name);
+        dept_hash_insert(list->key, list);
+        if (cursor->pending_count == cursor->pending_capacity) {
+            cursor->pending_capacity = cursor->pending_capacity ? cursor->pending_capacity * 2 : 16;
+            cursor->pending = (RankList**)realloc(cursor->pending, (size_t)cursor->pending_capacity * sizeof(RankList*));
+            if (!cursor->pending) { perror("Memory allocation error"); exit(1); }
+        }
+        cursor->pending[cursor->pending_count++] = list;
+        delta_stats.new_departments++;
+    }
+    qsort(group, (size_t)count, sizeof(Record), compare_delta_records);
+    for (int j = 0; j < count; j++) {
+        delta_stats.rows++;
+        if (j > 0 && strcmp(group[j].uni_name, group[j - 1].uni_name) == 0) continue; //Superseded by a later row
+        UniversityNode* uni = find_program(list, group[j].uni_name);
+        if (uni == NULL) {
+            uni = create_university(group[j].uni_name, group[j].score);
+            insert_into_sorted_list(list, uni);
+            uni_index_add(uni, list);
+            score_index_insert(uni, list);
+            delta_stats.inserted++;
+        } else if (uni->score != group[j].score) {
+            update_score(list, uni, group[j].score);
+            delta_stats.updated++;
+        } else {
+            delta_stats.unchanged++;
+        }
+    }
+}
+
+//Merges the pending departments into the cursor's leaf. When the result does
+//not fit, it is spread evenly over as many leaves as the leaf fill factor asks
+//for, and each new leaf is linked after its left neighbour and posted to the parent.
+void delta_flush_leaf(DeltaCursor* cursor) {
+    Node* leaf = cursor->leaf;
+    int pending = cursor->pending_count;
+    cursor->leaf = NULL;
+    cursor->pending_count = 0;
+    if (leaf == NULL || pending == 0) return;
+    int total = leaf->num_keys + pending;
+    KeyRef* keys = (KeyRef*)malloc((size_t)total * sizeof(KeyRef));
+    void** lists = (void**)malloc((size_t)total * sizeof(void*));
+    if (!keys || !lists) { perror("Memory allocation error"); exit(1); }
+    for (int i = 0, j = 0, n = 0; n < total; n++) {
+        bool take_leaf = j == pending ||
+                         (i < leaf->num_keys && strcmp(key_str(leaf->keys[i]), key_str(cursor->pending[j]->key)) < 0);
+        if (take_leaf) { keys[n] = leaf->keys[i]; lists[n] = leaf->pointers[i]; i++; }
+        else { keys[n] = cursor->pending[j]->key; lists[n] = cursor->pending[j]; j++; }
+    }
+    int fill = (int)((tree_order - 1) * leaf_fill_factor);
+    if (fill < 1) fill = 1;
+    int leaves = total < tree_order ? 1 : (total + fill - 1) / fill;
+    Node* current = leaf;
+    int n = 0;
+    for (int part = 0; part < leaves; part++) {
+        int size = total / leaves + (part < total % leaves ? 1 : 0);
+        if (part > 0) {
+            Node* new_leaf = create_node(true);
+            new_leaf->next = current->next;
+            current->next = new_leaf;
+            current = new_leaf;
         }
-        fclose(out);
-        run_count++;
-        current_heap_size = secondary_count;
-        for (int i = 0; i < secondary_count; i++) {
-            primary_heap[i] = secondary_storage[i];
+        for (int k = 0; k < size; k++, n++) {
+            node_set_key(current, k, keys[n]);
+            current->pointers[k] = lists[n];
         }
+        current->num_keys = size;
+        node_refresh_prefixes(current);
     }
-    free(primary_heap);
-    free(secondary_storage);
-    fclose(in);
-    return run_count;
+    //Post the separators left to right; earlier posts may have split the parents
+    current = leaf;
+    for (int part = 1; part < leaves; part++) {
+        Node* right = current->next;
+        split_count++;
+        insert_into_parent(current, separator_between(current->keys[current->num_keys - 1], right->keys[0]), right);
+        current = right;
+    }
+    delta_stats.leaves_added += leaves - 1;
+    free(keys);
+    free(lists);
 }
-void merge_runs(int num_runs){
-    if (num_runs <= 0) return;
-    FILE* in_files[num_runs];
-    for (int i = 0; i < num_runs; i++) {
-        char fname[20];
-        sprintf(fname, "run_%d.tmp", i);
-        in_files[i] = fopen(fname, "r");
-        if (!in_files[i]) { perror("Could not open run file"); return; }
-    }
-    FILE* out_file = fopen("sorted_data.csv", "w");
-    if (!out_file) { perror("Could not open output file"); return; }
-    MinHeapNode* heap_arr = (MinHeapNode*)malloc(num_runs * sizeof(MinHeapNode));
-    if(!heap_arr) { perror("Heap memory allocation error"); return; }
-    int heap_size = 0;
-    for (int i = 0; i < num_runs; i++) {
-        char line[512];
-        if (fgets(line, sizeof(line), in_files[i])) {
-            sscanf(line, "%[^,],%[^,],%f", heap_arr[heap_size].record.uni_name, heap_arr[heap_size].record.dept_name, &heap_arr[heap_size].record.score);
-            heap_arr[heap_size].file_index = i;
-            heap_size++;
-        }
-    }
-    for (int j = (heap_size / 2) - 1; j >= 0; j--) {
-        min_heapify_merge(heap_arr, heap_size, j);
-    }
-    while(heap_size > 0) {
-        MinHeapNode root_node = heap_arr[0];
-        fprintf(out_file, "%s,%s,%f\n", root_node.record.uni_name, root_node.record.dept_name, root_node.record.score);
-        char line[512];
-        if(fgets(line, sizeof(line), in_files[root_node.file_index])) {
-            sscanf(line, "%[^,],%[^,],%f", heap_arr[0].record.uni_name, heap_arr[0].record.dept_name, &heap_arr[0].record.score);
-        } else {
-            heap_arr[0] = heap_arr[heap_size - 1];
-            heap_size--;
+
+//find_leaf that also reports the smallest separator above key on the path:
+//every key below it descends to the same leaf
+Node* find_leaf_bounded(const char* key, KeyRef* upper, bool* bounded) {
+    *bounded = false;
+    Node* node = root;
+    while (!node->is_leaf) {
+        int i = node_upper_bound(node, key);
+        if (i < node->num_keys) { *upper = node->keys[i]; *bounded = true; }
+        node = (Node*)node->pointers[i];
+    }
+    return node;
+}
+
+//The entry of uni_name in a department's ranking, or NULL
+UniversityNode* find_program(const RankList* list, const char* uni_name) {
+    if (use_university_index) {
+        UniEntry* entry = uni_index_find(uni_name);
+        if (entry == NULL) return NULL;
+        int i = uni_programs_bound(entry, list->key, true);
+        return i < entry->count && entry->programs[i].dept == list->key ? entry->programs[i].uni : NULL;
+    }
+    for (UniversityNode* uni = rank_list_first(list); uni != NULL; uni = uni->links[0].next) {
+        if (strcmp(uni->university_name, uni_name) == 0) return uni;
+    }
+    return NULL;
+}
+
+//Delete and Update Functions
+
+//Removes one program; its department goes too when it was the last one.
+//Returns false when the program is not in the tree.
+bool delete_program(const char* dept_name, const char* uni_name) {
+    tree_write_lock();
+    Node* leaf = find_leaf(root, dept_name);
+    bool found = false;
+    if (leaf != NULL) {
+        int i = node_lower_bound(leaf, dept_name);
+        if (i < leaf->num_keys && strcmp(key_str(leaf->keys[i]), dept_name) == 0) {
+            RankList* list = (RankList*)leaf->pointers[i];
+            UniversityNode* uni = find_program(list, uni_name);
+            if (uni != NULL) {
+                found = true;
+                remove_program(list, uni);
+                if (list->count == 0) remove_department(leaf, i);
+            }
         }
-        if (heap_size > 0) {
-            min_heapify_merge(heap_arr, heap_size, 0);
-        }
-    }
-    free(heap_arr);
-    for (int j = 0; j < num_runs; j++) fclose(in_files[j]);
-    fclose(out_file);
-}
-void build_tree_from_sorted_file(const char* sorted_filename){
-    FILE* file = fopen(sorted_filename, "r");
-    if (!file) { perror("Could not open sorted file"); return; }
-    Node* current_leaf = create_node(true);
-    root = current_leaf;
-    first_leaf = current_leaf;
-    Node* leaf_list[10000];
-    char promoted_keys[10000][MAX_LINE_LEN];
-    int leaf_count = 0;
-    leaf_list[leaf_count++] = current_leaf;
-    char line[512];
-    char last_dept_name[MAX_LINE_LEN] = "";
-    UniversityNode* current_uni_list = NULL;
-    while (fgets(line, sizeof(line), file)) {
-        char uni_name[MAX_LINE_LEN], dept_name[MAX_LINE_LEN];
-        float score;
-        sscanf(line, "%[^,],%[^,],%f", uni_name, dept_name, &score);
-        if (strcmp(dept_name, last_dept_name) != 0 && strlen(last_dept_name) > 0) {
-            if (current_leaf->num_keys == ORDER - 1) {
-                split_count++;
-                Node* new_leaf = create_node(true);
-                current_leaf->next = new_leaf;
-                current_leaf = new_leaf;
-                strcpy(promoted_keys[leaf_count - 1], last_dept_name);
-                leaf_list[leaf_count++] = current_leaf;
-            }
-            strcpy(current_leaf->keys[current_leaf->num_keys], last_dept_name);
-            current_leaf->pointers[current_leaf->num_keys] = current_uni_list;
-            current_leaf->num_keys++;
-            current_uni_list = NULL;
+    }
+    tree_write_unlock();
+    return found;
+}
+
+//Moves a program to its new place in the department ranking and the score
+//index; the department key and its leaf are left alone
+bool update_program_score(const char* dept_name, const char* uni_name, float score) {
+    tree_write_lock();
+    RankList* list = find_department(dept_name);
+    UniversityNode* uni = list != NULL ? find_program(list, uni_name) : NULL;
+    if (uni != NULL) update_score(list, uni, score);
+    tree_write_unlock();
+    return uni != NULL;
+}
+
+//Deletes every (department, university) pair listed in a CSV with the columns
+//of the input; the score column is ignored
+bool apply_deletes(const char* filename) {
+    double start = wall_clock_seconds();
+    CsvReader reader;
+    if (!csv_open(&reader, filename)) { perror("Could not open file"); return false; }
+    CsvField header[CSV_MAX_FIELDS];
+    csv_next_record(&reader, header, CSV_MAX_FIELDS);
+    Record record;
+    while (csv_read_record(&reader, &record, 1)) {
+        delete_stats.rows++;
+        delete_stats.deleted += delete_program(record.dept_name, record.uni_name);
+    }
+    csv_close(&reader);
+    delete_stats.seconds += wall_clock_seconds() - start;
+    return true;
+}
+
+//Unlinks a program from its ranking and every secondary index, then frees it
+void remove_program(RankList* list, UniversityNode* uni) {
+    score_index_remove(uni, list);
+    uni_index_remove(uni, list);
+    rank_list_remove_at(list, rank_list_rank_of(list, uni));
+    free_university(uni);
+}
+
+//Drops the emptied department at slot i of its leaf. Its name stays in the
+//append-only key store.
+void remove_department(Node* leaf, int i) {
+    RankList* list = (RankList*)leaf->pointers[i];
+    dept_hash_remove(key_str(list->key));
+    rank_cache_forget(list);
+    rank_list_allocations--;
+    if (!use_arena) free(list);
+    remove_from_node(leaf, i, i);
+    delete_stats.departments_removed++;
+    rebalance_after_delete(leaf);
+}
+
+//Removes a key and a pointer from a node and closes the gaps. Leaves pass the
+//same index for both; internal nodes drop the separator and its right child.
+void remove_from_node(Node* node, int key_index, int pointer_index) {
+    int pointer_count = node->is_leaf ? node->num_keys : node->num_keys + 1;
+    for (int j = key_index; j < node->num_keys - 1; j++) {
+        node->keys[j] = node->keys[j + 1];
+        node->prefixes[j] = node->prefixes[j + 1];
+    }
+    for (int j = pointer_index; j < pointer_count - 1; j++) node->pointers[j] = node->pointers[j + 1];
+    node->num_keys--;
+    node_refresh_prefixes(node);
+}
+
+//Restores the minimum fill of a node that lost a key: a leaf keeps at least
+//half of its tree_order - 1 keys and an internal node half of its tree_order
+//children, rounded up, like the two halves a split produces. An underfull node
+//borrows from a sibling that has keys to spare and otherwise merges with one,
+//which may leave the parent underfull in turn. A root left without keys is
+//replaced by its only child, or by nothing once the last department is gone.
+void rebalance_after_delete(Node* node) {
+    if (node == root) {
+        if (node->num_keys > 0) return;
+        if (node->is_leaf) {
+            root = NULL;
+            first_leaf = NULL;
+        } else {
+            root = (Node*)node->pointers[0];
+            root->parent = NULL;
         }
-        UniversityNode* new_uni = create_university(uni_name, score);
-        insert_into_sorted_list(&current_uni_list, new_uni);
-        strcpy(last_dept_name, dept_name);
+        free_node(node);
+        return;
     }
-    if (current_uni_list != NULL) {
-         if (current_leaf->num_keys == ORDER - 1) {
-            split_count++;
-            Node* new_leaf = create_node(true);
-            current_leaf->next = new_leaf;
-            current_leaf = new_leaf;
-            strcpy(promoted_keys[leaf_count - 1], last_dept_name);
-            leaf_list[leaf_count++] = current_leaf;
+    int min_keys = node->is_leaf ? tree_order / 2 : (tree_order + 1) / 2 - 1;
+    if (node->num_keys >= min_keys) return;
+    Node* parent = node->parent;
+    int i = child_index(parent, node);
+    Node* left = i > 0 ? (Node*)parent->pointers[i - 1] : NULL;
+    Node* right = i < parent->num_keys ? (Node*)parent->pointers[i + 1] : NULL;
+    if (left == NULL && right == NULL) {
+        //An only child, left on the right spine of a sparse bulk build. Its parent
+        //has no keys, so it is rebalanced first: it borrows a sibling for node,
+        //merges into one or, as the root, makes node the root. Then node has a
+        //sibling of its own, or is the root, and is rebalanced in turn.
+        rebalance_after_delete(parent);
+        rebalance_after_delete(node);
+    } else if (left != NULL && left->num_keys > min_keys) {
+        borrow_from_left(node, left, i - 1);
+    } else if (right != NULL && right->num_keys > min_keys) {
+        borrow_from_right(node, right, i);
+    } else if (left != NULL) {
+        merge_with_right(left, node, i - 1);
+    } else {
+        merge_with_right(node, right, i);
+    }
+}
+
+int child_index(const Node* parent, const Node* child) {
+    int i = 0;
+    while (parent->pointers[i] != child) i++;
+    return i;
+}
+
+//Moves the last entry of the left sibling to the front of node. Leaves get a
+//fresh separator; internal nodes rotate the separator down and the sibling's
+//last key up.
+void borrow_from_left(Node* node, Node* left, int separator) {
+    Node* parent = node->parent;
+    int pointer_count = node->is_leaf ? node->num_keys : node->num_keys + 1;
+    for (int j = node->num_keys; j > 0; j--) {
+        node->keys[j] = node->keys[j - 1];
+        node->prefixes[j] = node->prefixes[j - 1];
+    }
+    for (int j = pointer_count; j > 0; j--) node->pointers[j] = node->pointers[j - 1];
+    if (node->is_leaf) {
+        node_set_key(node, 0, left->keys[left->num_keys - 1]);
+        node->pointers[0] = left->pointers[left->num_keys - 1];
+    } else {
+        node_set_key(node, 0, parent->keys[separator]);
+        node->pointers[0] = left->pointers[left->num_keys];
+        ((Node*)node->pointers[0])->parent = node;
+    }
+    node->num_keys++;
+    left->num_keys--;
+    node_refresh_prefixes(node);
+    node_refresh_prefixes(left);
+    node_set_key(parent, separator, node->is_leaf ? separator_between(left->keys[left->num_keys - 1], node->keys[0])
+                                                  : left->keys[left->num_keys]);
+    node_refresh_prefixes(parent);
+    borrow_count++;
+}
+
+//Moves the first entry of the right sibling to the end of node
+void borrow_from_right(Node* node, Node* right, int separator) {
+    Node* parent = node->parent;
+    KeyRef promoted = right->keys[0];
+    if (node->is_leaf) {
+        node_set_key(node, node->num_keys, right->keys[0]);
+        node->pointers[node->num_keys] = right->pointers[0];
+    } else {
+        node_set_key(node, node->num_keys, parent->keys[separator]);
+        node->pointers[node->num_keys + 1] = right->pointers[0];
+        ((Node*)right->pointers[0])->parent = node;
+    }
+    node->num_keys++;
+    remove_from_node(right, 0, 0);
+    node_refresh_prefixes(node);
+    node_set_key(parent, separator, node->is_leaf ? separator_between(node->keys[node->num_keys - 1], right->keys[0]) : promoted);
+    node_refresh_prefixes(parent);
+    borrow_count++;
+}
+
+//Appends right to left, pulling the separator down between internal nodes,
+//frees right and removes it from the parent
+void merge_with_right(Node* left, Node* right, int separator) {
+    Node* parent = left->parent;
+    int n = left->num_keys;
+    if (!left->is_leaf) {
+        node_set_key(left, n++, parent->keys[separator]);
+        for (int j = 0; j <= right->num_keys; j++) {
+            left->pointers[n + j] = right->pointers[j];
+            ((Node*)right->pointers[j])->parent = left;
         }
-        strcpy(current_leaf->keys[current_leaf->num_keys], last_dept_name);
-        current_leaf->pointers[current_leaf->num_keys] = current_uni_list;
-        current_leaf->num_keys++;
+    } else {
+        for (int j = 0; j < right->num_keys; j++) left->pointers[n + j] = right->pointers[j];
+        left->next = right->next;
+    }
+    for (int j = 0; j < right->num_keys; j++) node_set_key(left, n + j, right->keys[j]);
+    left->num_keys = n + right->num_keys;
+    node_refresh_prefixes(left);
+    free_node(right);
+    merge_count++;
+    remove_from_node(parent, separator, separator + 1);
+    rebalance_after_delete(parent);
+}
+
+//Concurrency Functions
+
+//A coarse global lock, not a concurrent tree: query threads share tree_lock for
+//reading while insert() takes it for writing, so queries overlap one another
+//but never an insert. Every structure an insert touches (nodes, key store, hash
+//tables, rankings and the secondary indexes) is guarded by the one lock, so a
+//query never sees a half-finished split or a key store being moved by realloc.
+//There is no per-node latching or version validation. The lock prefers writers
+//so a steady stream of queries cannot starve the loader.
+void concurrent_mode_begin() {
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    if (pthread_rwlock_init(&tree_lock, &attr) != 0) { perror("Lock initialization failed"); exit(1); }
+    pthread_rwlockattr_destroy(&attr);
+    concurrent_mode = true;
+}
+
+void concurrent_mode_end() {
+    if (!concurrent_mode) return;
+    concurrent_mode = false;
+    pthread_rwlock_destroy(&tree_lock);
+}
+
+void tree_read_lock() {
+    if (concurrent_mode) pthread_rwlock_rdlock(&tree_lock);
+}
+
+void tree_read_unlock() {
+    if (concurrent_mode) pthread_rwlock_unlock(&tree_lock);
+}
+
+void tree_write_lock() {
+    if (concurrent_mode) pthread_rwlock_wrlock(&tree_lock);
+}
+
+void tree_write_unlock() {
+    if (concurrent_mode) pthread_rwlock_unlock(&tree_lock);
+}
+
+//Reservoir sample of up to capacity rows of the input; returns the sample size
+long sample_queries(const char* filename, SampleQuery* samples, long capacity, uint64_t seed) {
+    CsvReader reader;
+    if (!csv_open(&reader, filename)) { perror("Could not open file"); return 0; }
+    CsvField header[CSV_MAX_FIELDS];
+    csv_next_record(&reader, header, CSV_MAX_FIELDS);
+    uint64_t state = seed;
+    Record record;
+    long seen = 0;
+    while (csv_read_record(&reader, &record, 1)) {
+        long slot = seen < capacity ? seen : (long)(bench_random(&state) % (uint64_t)(seen + 1));
+        seen++;
+        if (slot >= capacity) continue;
+        strcpy(samples[slot].dept_name, record.dept_name);
+        strcpy(samples[slot].uni_name, record.uni_name);
     }
-    fclose(file);
-    if (leaf_count > 1) {
-        root = build_parent_level(leaf_list, leaf_count, promoted_keys);
+    csv_close(&reader);
+    return seen < capacity ? seen : capacity;
+}
+
+//Alternates rank queries and (department, university) lookups over the samples.
+//Rank queries skip the rank cache: it is not synchronized, so readers without
+//the lock would race on it, and cache hits would make the variants incomparable.
+void* reader_worker(void* arg) {
+    ReaderWorker* worker = (ReaderWorker*)arg;
+    long i = worker->first;
+    for (long n = 0; worker->ops > 0 ? n < worker->ops : !__atomic_load_n(&loader_done, __ATOMIC_ACQUIRE); n++) {
+        const SampleQuery* sample = &worker->samples[i];
+        if (n & 1) worker->hits += search_university(sample->uni_name, sample->dept_name);
+        else worker->hits += find_by_rank_with(sample->dept_name, 1 + (int)(n & 7), false) != NULL;
+        worker->completed++;
+        if (++i == worker->sample_count) i = 0;
     }
+    return NULL;
+}
+
+void* loader_worker(void* arg) {
+    double* seconds = (double*)arg;
+    double start = wall_clock_seconds();
+    run_sequential_insertion();
+    *seconds = wall_clock_seconds() - start;
+    __atomic_store_n(&loader_done, 1, __ATOMIC_RELEASE);
+    return NULL;
 }
-Node* build_parent_level(Node** children, int count, const char (*keys_from_below)[MAX_LINE_LEN]){
-    if (count <= 1) {
-        if (count == 1) children[0]->parent = NULL;
-        return children[0];
+
+//Starts threads readers of ops queries each (or running until the loader is
+//done when ops is 0) and waits for them; returns the elapsed seconds
+double run_readers(ReaderWorker* workers, int threads, const SampleQuery* samples, long sample_count, long ops) {
+    pthread_t* handles = (pthread_t*)malloc((size_t)threads * sizeof(pthread_t));
+    if (!handles) { perror("Memory allocation error"); exit(1); }
+    double start = wall_clock_seconds();
+    int started = 0;
+    for (int t = 0; t < threads; t++) {
+        memset(&workers[t], 0, sizeof(ReaderWorker));
+        workers[t].samples = samples;
+        workers[t].sample_count = sample_count;
+        workers[t].first = (long)((double)sample_count * t / threads);
+        workers[t].ops = ops;
+        if (pthread_create(&handles[t], NULL, reader_worker, &workers[t]) != 0) break;
+        started++;
     }
+    for (int t = started; t < threads; t++) reader_worker(&workers[t]);
+    for (int t = 0; t < started; t++) pthread_join(handles[t], NULL);
+    double seconds = wall_clock_seconds() - start;
+    free(handles);
+    return seconds;
+}
 
-    Node* parent_list[5000];
-    char new_promoted_keys[5000][MAX_LINE_LEN];
-    int parent_count = 0;
-    int promoted_count = 0;
-    
-    int child_idx = 0;
-    while(child_idx < count) {
-        Node* current_parent = create_node(false);
-        parent_list[parent_count++] = current_parent;
-        
-        int keys_in_parent = 0;
-        
-        current_parent->pointers[keys_in_parent] = children[child_idx];
-        children[child_idx]->parent = current_parent;
-        child_idx++;
-
-        while(keys_in_parent < ORDER - 1 && child_idx < count) {
-            strcpy(current_parent->keys[keys_in_parent], keys_from_below[child_idx - 1]);
-            current_parent->pointers[keys_in_parent + 1] = children[child_idx];
-            children[child_idx]->parent = current_parent;
-            keys_in_parent++;
-            child_idx++;
-        }
-        current_parent->num_keys = keys_in_parent;
-
-        if(child_idx < count) {
-             split_count++;
-             strcpy(new_promoted_keys[promoted_count++], keys_from_below[child_idx - 1]);
+//0, 1, 2, 4, ... and finally max_threads itself
+int next_thread_count(int threads, int max_threads) {
+    if (threads == 0) return 1;
+    if (threads == max_threads) return max_threads + 1;
+    return threads * 2 < max_threads ? threads * 2 : max_threads;
+}
+
+//Query throughput for 1, 2, 4, ... max_threads reader threads, first on a
+//bulk-loaded tree with and without the lock, then while a loader thread
+//inserts input_file through insert(). Each insert holds the global lock
+//exclusively, so readers stall for its duration.
+void run_concurrency_benchmark(int max_threads, long queries, uint64_t seed) {
+    SampleQuery* samples = (SampleQuery*)malloc((size_t)queries * sizeof(SampleQuery));
+    ReaderWorker* workers = (ReaderWorker*)malloc((size_t)max_threads * sizeof(ReaderWorker));
+    if (!samples || !workers) { perror("Benchmark allocation failed"); exit(1); }
+    long sample_count = sample_queries(input_file, samples, queries, seed);
+    if (sample_count == 0) { printf("No records loaded from %s.\n", input_file); free(samples); free(workers); return; }
+    printf("Concurrency benchmark: %s, order %d, %ld queries per thread, up to %d reader threads\n",
+           input_file, tree_order, queries, max_threads);
+
+    free_tree(root);
+    free_key_store();
+    reset_metrics();
+    run_bulk_loading();
+    printf("read-only (bulk-loaded tree)\n");
+    double base_rate = 0;
+    for (int threads = 1; threads <= max_threads; threads = next_thread_count(threads, max_threads)) {
+        double rates[2];
+        for (int variant = 0; variant < 2; variant++) {
+            if (variant == 0) concurrent_mode_begin();
+            double seconds = run_readers(workers, threads, samples, sample_count, queries);
+            concurrent_mode_end();
+            rates[variant] = seconds > 0 ? (double)threads * queries / seconds : 0.0;
         }
+        if (threads == 1) base_rate = rates[0];
+        printf("  %3d threads  %8.3f Mqueries/sec locked (%.2fx), %8.3f Mqueries/sec without the lock\n",
+               threads, rates[0] / 1e6, base_rate > 0 ? rates[0] / base_rate : 0.0, rates[1] / 1e6);
     }
-    
-    return build_parent_level(parent_list, parent_count, new_promoted_keys);
+
+    printf("with a sequential loader (each insert excludes all readers)\n");
+    for (int threads = 0; threads <= max_threads; threads = next_thread_count(threads, max_threads)) {
+        free_tree(root);
+        free_key_store();
+        reset_metrics();
+        concurrent_mode_begin();
+        loader_done = 0;
+        double loader_seconds = 0;
+        pthread_t loader;
+        if (pthread_create(&loader, NULL, loader_worker, &loader_seconds) != 0) { perror("Could not start loader"); exit(1); }
+        double seconds = threads > 0 ? run_readers(workers, threads, samples, sample_count, 0) : 0;
+        pthread_join(loader, NULL);
+        concurrent_mode_end();
+        long completed = 0, hits = 0;
+        for (int t = 0; t < threads; t++) { completed += workers[t].completed; hits += workers[t].hits; }
+        printf("  %3d threads  loader %.4f sec", threads, loader_seconds);
+        if (threads > 0) {
+            printf(", %8.3f Mqueries/sec (%.1f%% answered)", seconds > 0 ? completed / seconds / 1e6 : 0.0,
+                   completed > 0 ? 100.0 * hits / completed : 0.0);
+        }
+        printf("\n");
+    }
+    free(samples);
+    free(workers);
+}
+
+//Benchmark Functions
+
+//splitmix64: small, seedable and good enough for synthetic data and query mixes
+uint64_t bench_random(uint64_t* state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
 }
-void swap_records(Record* a, Record* b){
-    Record temp = *a; *a = *b; *b = temp;
+
+uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
 }
-void min_heapify_replacement(Record heap[], int size, int i){
-    int smallest = i; int left = 2 * i + 1; int right = 2 * i + 2;
-    if (left < size && compare_records(&heap[left], &heap[smallest]) < 0) smallest = left;
-    if (right < size && compare_records(&heap[right], &heap[smallest]) < 0) smallest = right;
-    if (smallest != i) {
-        swap_records(&heap[i], &heap[smallest]);
-        min_heapify_replacement(heap, size, smallest);
+
+//Writes a CSV with the same columns as yok_atlas.csv. Department popularity is
+//skewed towards low ids and about one department in sixteen carries a comma in
+//its name, so the quoting path of the reader is exercised as well.
+bool generate_csv(const char* filename, long rows, uint64_t seed) {
+    static const char* const subjects[] = {
+        "Bilgisayar", "Elektrik", "Makine", "Insaat", "Endustri", "Kimya", "Fizik", "Matematik",
+        "Biyoloji", "Tarih", "Iktisat", "Isletme", "Hukuk", "Tip", "Mimarlik", "Psikoloji"};
+    static const char* const kinds[] = {
+        "Muhendisligi", "Bilimleri", "Ogretmenligi", "Teknolojisi",
+        "Yonetimi", "Egitimi", "Calismalari", "Programi"};
+    static const char* const cities[] = {
+        "ANKARA", "ISTANBUL", "IZMIR", "BURSA", "KONYA", "ADANA", "TRABZON", "ERZURUM",
+        "SAMSUN", "KAYSERI", "ESKISEHIR", "MALATYA", "SAKARYA", "DENIZLI", "VAN", "EDIRNE"};
+    static const char* const uni_kinds[] = {
+        "UNIVERSITESI", "TEKNIK UNIVERSITESI", "TEKNOLOJI UNIVERSITESI", "VAKIF UNIVERSITESI"};
+    FILE* file = fopen(filename, "w");
+    if (!file) { perror("Could not create file"); return false; }
+    setvbuf(file, NULL, _IOFBF, RUN_BUFFER_SIZE);
+    long departments = rows / 20 > 0 ? rows / 20 : 1;
+    long universities = rows / 32 > 0 ? rows / 32 : 1;
+    uint64_t state = seed;
+    fprintf(file, "ID,Üniversite,Bölüm,En Küçük Puan\n");
+    for (long id = 1; id <= rows; id++) {
+        double u = (double)(bench_random(&state) >> 11) / 9007199254740992.0;
+        long d = (long)(u * u * (double)departments);
+        long n = (long)(bench_random(&state) % (uint64_t)universities);
+        double score = 150.0 + (double)(bench_random(&state) % 41000000) / 100000.0;
+        char dept[MAX_LINE_LEN];
+        char uni[MAX_LINE_LEN];
+        int len = snprintf(dept, sizeof(dept), "%s %s", subjects[d % 16], kinds[(d / 16) % 8]);
+        if (d >= 128) len += snprintf(dept + len, sizeof(dept) - len, " %ld", d / 128);
+        if (d % 16 == 5) snprintf(dept + len, sizeof(dept) - len, " (Ingilizce, Burslu)");
+        len = snprintf(uni, sizeof(uni), "%s %s", cities[n % 16], uni_kinds[(n / 16) % 4]);
+        if (n >= 64) snprintf(uni + len, sizeof(uni) - len, " %ld", n / 64);
+        if (strchr(dept, ',')) fprintf(file, "%ld,%s,\"%s\",%.5f\n", id, uni, dept, score);
+        else fprintf(file, "%ld,%s,%s,%.5f\n", id, uni, dept, score);
     }
+    if (fclose(file) != 0) { perror("Could not write file"); return false; }
+    return true;
 }
-void swap_heap_nodes(MinHeapNode* a, MinHeapNode* b){
-    MinHeapNode temp = *a; *a = *b; *b = temp;
+
+int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
 }
-void min_heapify_merge(MinHeapNode heap_arr[], int size, int i){
-    int smallest = i; int left = 2 * i + 1; int right = 2 * i + 2;
-    if (left < size && compare_records(&heap_arr[left].record, &heap_arr[smallest].record) < 0) smallest = left;
-    if (right < size && compare_records(&heap_arr[right].record, &heap_arr[smallest].record) < 0) smallest = right;
-    if (smallest != i) {
-        swap_heap_nodes(&heap_arr[i], &heap_arr[smallest]);
-        min_heapify_merge(heap_arr, size, smallest);
+
+//Sorts the samples in place and prints p50/p95/p99/max in nanoseconds
+void print_latency(const char* label, uint64_t* samples, long count) {
+    if (count == 0) return;
+    qsort(samples, (size_t)count, sizeof(uint64_t), compare_u64);
+    printf("  %-14s p50 %6llu ns  p95 %6llu ns  p99 %6llu ns  max %8llu ns\n", label,
+           (unsigned long long)samples[(count - 1) * 50 / 100],
+           (unsigned long long)samples[(count - 1) * 95 / 100],
+           (unsigned long long)samples[(count - 1) * 99 / 100],
+           (unsigned long long)samples[count - 1]);
+}
+
+//Cumulative Zipf (s = 1) weights of n items: item i is drawn with
+//probability proportional to 1 / (i + 1)
+void zipf_cdf(double* cdf, long n) {
+    double total = 0;
+    for (long i = 0; i < n; i++) cdf[i] = total += 1.0 / (double)(i + 1);
+    for (long i = 0; i < n; i++) cdf[i] /= total;
+}
+
+long zipf_sample(const double* cdf, long n, uint64_t* state) {
+    double u = (double)(bench_random(state) >> 11) / 9007199254740992.0;
+    long lo = 0, hi = n - 1;
+    while (lo < hi) {
+        long mid = (lo + hi) / 2;
+        if (cdf[mid] <= u) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+//Builds the tree from input_file with both loaders in turn and times the build
+//and individual rank and (department, university) lookups. Queries are drawn
+//from the loaded data with a fixed seed, so both trees see the same workload.
+//Only timings are reported; --self-test checks the answers. Rank queries skip
+//the rank cache except in the cached run of the skewed workload.
+void run_benchmark(long queries, uint64_t seed) {
+    const char* mode_names[] = {"sequential", "bulk"};
+    uint64_t* samples = (uint64_t*)malloc((size_t)queries * sizeof(uint64_t));
+    const char** query_depts = (const char**)malloc((size_t)queries * sizeof(char*));
+    int* query_ranks = (int*)malloc((size_t)queries * sizeof(int));
+    BatchQuery* batch = (BatchQuery*)malloc(DEFAULT_BATCH_SIZE * sizeof(BatchQuery));
+    BatchQuery** batch_sorted = (BatchQuery**)malloc(DEFAULT_BATCH_SIZE * sizeof(BatchQuery*));
+    if (!samples || !query_depts || !query_ranks || !batch || !batch_sorted) { perror("Benchmark allocation failed"); exit(1); }
+    printf("Benchmark: %s, order %d, %ld queries per type, seed %llu\n",
+           input_file, tree_order, queries, (unsigned long long)seed);
+    BulkOptions options = {sort_threads, leaf_fill_factor, internal_fill_factor, false};
+    for (int mode = 0; mode < 2; mode++) {
+        free_tree(root);
+        free_key_store();
+        reset_metrics();
+        double start = wall_clock_seconds();
+        if (mode == 0) run_sequential_insertion();
+        else run_bulk_loading_with(&options);
+        double build_seconds = wall_clock_seconds() - start;
+
+        //Every department with its ranking, in key order along the leaf chain
+        long departments = 0, records = 0;
+        for (Node* leaf = first_leaf; leaf != NULL; leaf = leaf->next) departments += leaf->num_keys;
+        if (departments == 0) { printf("No records loaded from %s.\n", input_file); break; }
+        const char** dept_names = (const char**)malloc((size_t)departments * sizeof(char*));
+        RankList** lists = (RankList**)malloc((size_t)departments * sizeof(RankList*));
+        if (!dept_names || !lists) { perror("Benchmark allocation failed"); exit(1); }
+        long d = 0;
+        for (Node* leaf = first_leaf; leaf != NULL; leaf = leaf->next) {
+            for (int i = 0; i < leaf->num_keys; i++, d++) {
+                dept_names[d] = key_str(leaf->keys[i]);
+                lists[d] = (RankList*)leaf->pointers[i];
+                records += lists[d]->count;
+            }
+        }
+        uint64_t state = seed;
+        for (long q = 0; q < queries; q++) {
+            long pick = (long)(bench_random(&state) % (uint64_t)departments);
+            query_depts[q] = dept_names[pick];
+            query_ranks[q] = 1 + (int)(bench_random(&state) % (uint64_t)lists[pick]->count);
+        }
+
+        printf("%-10s build %.4f sec, %.0f records/sec, %lld nodes, height %d, %.4f MB\n",
+               mode_names[mode], build_seconds, build_seconds > 0 ? records / build_seconds : 0.0,
+               node_allocations, calculate_tree_height(), calculate_memory_usage());
+        for (long q = 0; q < queries; q++) {
+            uint64_t t0 = monotonic_ns();
+            UniversityNode* hit = find_by_rank_with(query_depts[q], query_ranks[q], false);
+            samples[q] = monotonic_ns() - t0;
+            benchmark_sink += hit != NULL;
+        }
+        print_latency("rank query", samples, queries);
+        //Descent plus leaf search alone, with the key prefixes and with strcmp only
+        double search_seconds[2];
+        for (int variant = 0; variant < 2; variant++) {
+            bool prefixes = variant == 0;
+            long checksum = 0;
+            start = wall_clock_seconds();
+            for (long q = 0; q < queries; q++) {
+                checksum += node_lower_bound_with(find_leaf_with(root, query_depts[q], prefixes), query_depts[q], prefixes);
+            }
+            search_seconds[variant] = wall_clock_seconds() - start;
+            benchmark_sink += checksum;
+        }
+        printf("  %-14s %.0f ns/query with key prefixes, %.0f ns/query strcmp only\n", "key search",
+               search_seconds[0] * 1e9 / queries, search_seconds[1] * 1e9 / queries);
+        //Department -> ranking through the hash index and through the tree
+        if (dept_hash.count > 0) {
+            for (int variant = 0; variant < 2; variant++) {
+                long hits = 0;
+                start = wall_clock_seconds();
+                for (long q = 0; q < queries; q++) hits += find_department_with(query_depts[q], variant == 0) != NULL;
+                search_seconds[variant] = wall_clock_seconds() - start;
+                benchmark_sink += hits;
+            }
+            printf("  %-14s %.0f ns/query via hash index, %.0f ns/query via tree\n", "department",
+                   search_seconds[0] * 1e9 / queries, search_seconds[1] * 1e9 / queries);
+        }
+        //The same rank queries, untimed individually, independent and then batched
+        start = wall_clock_seconds();
+        for (long q = 0; q < queries; q++) benchmark_sink += find_by_rank_with(query_depts[q], query_ranks[q], false) != NULL;
+        double independent_seconds = wall_clock_seconds() - start;
+        double batched_seconds = 0;
+        for (long first = 0; first < queries; first += DEFAULT_BATCH_SIZE) {
+            int count = (int)(queries - first < DEFAULT_BATCH_SIZE ? queries - first : DEFAULT_BATCH_SIZE);
+            for (int q = 0; q < count; q++) {
+                memset(&batch[q], 0, sizeof(BatchQuery));
+                batch[q].type = 'R';
+                strcpy(batch[q].dept_name, query_depts[first + q]);
+                batch[q].rank = query_ranks[first + q];
+            }
+            start = wall_clock_seconds();
+            resolve_batch(batch, batch_sorted, count);
+            batched_seconds += wall_clock_seconds() - start;
+            for (int q = 0; q < count; q++) benchmark_sink += batch[q].result_name != NULL;
+        }
+        printf("  %-14s %.0f ns/query batched (%d per batch), %.0f ns/query independent\n", "rank batch",
+               batched_seconds * 1e9 / queries, DEFAULT_BATCH_SIZE, independent_seconds * 1e9 / queries);
+        //Skewed traffic: Zipf-distributed departments, in shuffled key order, and
+        //Zipf-distributed ranks among the top ZIPF_RANK_DEPTH
+        double* dept_cdf = (double*)malloc((size_t)departments * sizeof(double));
+        long* popularity = (long*)malloc((size_t)departments * sizeof(long));
+        const char** zipf_depts = (const char**)malloc((size_t)queries * sizeof(char*));
+        int* zipf_ranks = (int*)malloc((size_t)queries * sizeof(int));
+        if (!dept_cdf || !popularity || !zipf_depts || !zipf_ranks) { perror("Benchmark allocation failed"); exit(1); }
+        double rank_cdf[ZIPF_RANK_DEPTH];
+        zipf_cdf(dept_cdf, departments);
+        zipf_cdf(rank_cdf, ZIPF_RANK_DEPTH);
+        for (long i = 0; i < departments; i++) popularity[i] = i;
+        for (long i = departments - 1; i > 0; i--) {
+            long j = (long)(bench_random(&state) % (uint64_t)(i + 1));
+            long t = popularity[i]; popularity[i] = popularity[j]; popularity[j] = t;
+        }
+        for (long q = 0; q < queries; q++) {
+            long pick = popularity[zipf_sample(dept_cdf, departments, &state)];
+            int rank = 1 + (int)zipf_sample(rank_cdf, ZIPF_RANK_DEPTH, &state);
+            zipf_depts[q] = dept_names[pick];
+            zipf_ranks[q] = rank <= lists[pick]->count ? rank : lists[pick]->count;
+        }
+        //The cached run uses the --cache-size cache, from empty; --cache-size 0 skips it
+        int cache_variants = rank_cache_size > 0 ? 2 : 1;
+        for (int variant = 0; variant < cache_variants; variant++) {
+            rank_cache_free();
+            memset(&rank_cache, 0, sizeof(RankCache));
+            for (long q = 0; q < queries; q++) {
+                uint64_t t0 = monotonic_ns();
+                UniversityNode* hit = find_by_rank_with(zipf_depts[q], zipf_ranks[q], variant == 1);
+                samples[q] = monotonic_ns() - t0;
+                benchmark_sink += hit != NULL;
+            }
+            print_latency(variant == 0 ? "zipf uncached" : "zipf cached", samples, queries);
+        }
+        if (cache_variants == 2) {
+            printf("  %-14s %zu entries, %.1f%% hits, %lld evictions\n", "rank cache", rank_cache.set_count * RANK_CACHE_WAYS,
+                   100.0 * rank_cache.hits / queries, rank_cache.evictions);
+        }
+        rank_cache_free();
+        free(dept_cdf);
+        free(popularity);
+        free(zipf_depts);
+        free(zipf_ranks);
+        //Lookups search for the university the rank query found
+        for (long q = 0; q < queries; q++) {
+            const char* uni_name = find_by_rank_with(query_depts[q], query_ranks[q], false)->university_name;
+            uint64_t t0 = monotonic_ns();
+            bool hit = search_university(uni_name, query_depts[q]);
+            samples[q] = monotonic_ns() - t0;
+            benchmark_sink += hit;
+        }
+        print_latency("lookup query", samples, queries);
+        if (uni_index.count > 0) {
+            for (long q = 0; q < queries; q++) {
+                const char* uni_name = find_by_rank_with(query_depts[q], query_ranks[q], false)->university_name;
+                uint64_t t0 = monotonic_ns();
+                bool hit = search_university_with(uni_name, query_depts[q], false);
+                samples[q] = monotonic_ns() - t0;
+                benchmark_sink += hit;
+            }
+            print_latency("lookup (scan)", samples, queries);
+        }
+        //Programs scoring within one point of a random program, via the score index
+        //and by scanning the head of every ranking
+        if (score_index.count > 0) {
+            long range_queries = queries < 1000 ? queries : 1000;
+            long matches[2] = {0, 0};
+            for (int variant = 0; variant < 2; variant++) {
+                uint64_t range_state = seed;
+                start = wall_clock_seconds();
+                for (long q = 0; q < range_queries; q++) {
+                    long pick = (long)(bench_random(&range_state) % (uint64_t)departments);
+                    float high = rank_list_at(lists[pick], 1 + (int)(bench_random(&range_state) % (uint64_t)lists[pick]->count))->score;
+                    float low = high - 1.0f;
+                    if (variant == 0) {
+                        for (ScoreNode* node = score_index_seek(high); node != NULL && node->uni->score >= low; node = node->next[0]) matches[0]++;
+                    } else {
+                        for (long i = 0; i < departments; i++) {
+                            for (UniversityNode* uni = rank_list_first(lists[i]); uni != NULL && uni->score >= low; uni = uni->links[0].next) {
+                                matches[1] += uni->score <= high;
+                            }
+                        }
+                    }
+                }
+                search_seconds[variant] = wall_clock_seconds() - start;
+            }
+            benchmark_sink += matches[1];
+            printf("  %-14s %.0f ns/query via score index, %.0f ns/query scanning rankings (%.1f programs each)\n", "score range",
+                   search_seconds[0] * 1e9 / range_queries, search_seconds[1] * 1e9 / range_queries, (double)matches[0] / range_queries);
+        }
+        //The same rank queries and lookups on a frozen snapshot of the tree
+        double mutable_memory = calculate_memory_usage();
+        start = wall_clock_seconds();
+        if (freeze_tree(&frozen_tree)) {
+            double freeze_seconds = wall_clock_seconds() - start;
+            for (long q = 0; q < queries; q++) {
+                uint64_t t0 = monotonic_ns();
+                const PagedValue* value = frozen_find_department(&frozen_tree, query_depts[q]);
+                const PagedEntry* hit = value != NULL && (uint32_t)query_ranks[q] <= value->count ? &frozen_tree.entries[value->first_entry + query_ranks[q] - 1] : NULL;
+                samples[q] = monotonic_ns() - t0;
+                benchmark_sink += hit != NULL;
+            }
+            print_latency("rank frozen", samples, queries);
+            for (long q = 0; q < queries; q++) {
+                const char* uni_name = find_by_rank_with(query_depts[q], query_ranks[q], false)->university_name;
+                uint64_t t0 = monotonic_ns();
+                bool hit = search_university(uni_name, query_depts[q]); //Dispatches to the snapshot
+                samples[q] = monotonic_ns() - t0;
+                benchmark_sink += hit;
+            }
+            print_latency("lookup frozen", samples, queries);
+            printf("  %-14s %.4f sec to freeze, %.4f MB frozen vs %.4f MB mutable\n", "frozen", freeze_seconds,
+                   frozen_tree_bytes(&frozen_tree) / (1024.0 * 1024.0), mutable_memory);
+            frozen_tree_free(&frozen_tree);
+        }
+        //Churn: delete a random half of the programs, move every remaining score,
+        //then query the surviving departments and report the fill
+        ChurnPlan churn;
+        churn_plan(&churn, lists, departments, records, &state);
+        long long nodes_before = node_allocations, merges_before = merge_count, borrows_before = borrow_count;
+        long deleted = 0, updated = 0;
+        char dept[MAX_LINE_LEN];
+        start = wall_clock_seconds();
+        for (long p = 0; p < churn.programs / 2; p++) {
+            strcpy(dept, key_str(churn.owners[p]));
+            deleted += delete_program(dept, churn.names[p]);
+        }
+        double delete_seconds = wall_clock_seconds() - start;
+        start = wall_clock_seconds();
+        for (long p = churn.programs / 2; p < churn.programs; p++) {
+            updated += update_program_score(key_str(churn.owners[p]), churn.names[p], churn.scores[p] + 1.0f);
+        }
+        double update_seconds = wall_clock_seconds() - start;
+        printf("  %-14s %.0f ns/delete (%ld deleted, %lld merges, %lld borrows), %.0f ns/update (%ld updated)\n", "churn",
+               delete_seconds * 1e9 / (churn.programs / 2 > 0 ? churn.programs / 2 : 1), deleted, merge_count - merges_before,
+               borrow_count - borrows_before, update_seconds * 1e9 / (churn.programs - churn.programs / 2), updated);
+        long remaining = 0;
+        for (Node* leaf = first_leaf; leaf != NULL; leaf = leaf->next) {
+            for (int i = 0; i < leaf->num_keys; i++) dept_names[remaining++] = key_str(leaf->keys[i]);
+        }
+        if (remaining > 0) {
+            for (long q = 0; q < queries; q++) {
+                const char* name = dept_names[bench_random(&state) % (uint64_t)remaining];
+                uint64_t t0 = monotonic_ns();
+                UniversityNode* hit = find_by_rank_with(name, 1, false);
+                samples[q] = monotonic_ns() - t0;
+                benchmark_sink += hit != NULL;
+            }
+            print_latency("rank churned", samples, queries);
+            FillStats fill = {0, 0, 0, 0, 0};
+            calculate_fill_stats(root, &fill);
+            printf("  %-14s %lld nodes (%lld before), height %d, leaves %.1f%% full, %ld nodes under the minimum\n", "after churn",
+                   node_allocations, nodes_before, calculate_tree_height(),
+                   100.0 * fill.leaf_keys / ((double)fill.leaves * (tree_order - 1)), fill.underfull);
+        }
+        churn_plan_free(&churn);
+        free(dept_names);
+        free(lists);
+    }
+    //Bulk builds by thread count. The runs are merged into one before each build,
+    //so the build time leaves out the final merge, whose fan-in grows with the
+    //number of run generation workers; each phase is reported on its own.
+    int max_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (max_threads < 4) max_threads = 4;
+    double serial_seconds = 0;
+    options.single_run = true;
+    for (int threads = 1; threads <= max_threads; threads = next_thread_count(threads, max_threads)) {
+        free_tree(root);
+        free_key_store();
+        reset_metrics();
+        options.threads = threads;
+        run_bulk_loading_with(&options);
+        if (threads == 1) serial_seconds = tree_build_seconds;
+        printf("%-10s %d threads: build %.4f sec (%.2fx), merge %.4f sec (%d passes), run generation %.4f sec\n", "bulk", threads,
+               tree_build_seconds, tree_build_seconds > 0 ? serial_seconds / tree_build_seconds : 0.0,
+               merge_pass_seconds, merge_passes, run_generation_seconds);
+    }
+    free(samples);
+    free(query_depts);
+    free(query_ranks);
+    free(batch);
+    free(batch_sorted);
+}
+
+//Self-Test Functions
+
+//Counts a check and reports it on stderr when it failed
+void self_check(bool ok, const char* label, const char* what) {
+    self_test_checks++;
+    if (ok) return;
+    self_test_failures++;
+    fprintf(stderr, "FAIL %s: %s\n", label, what);
+}
+
+//Every program of lists in shuffled order, with its department and score.
+//Names are copied: deleting a program frees the one in its node.
+void churn_plan(ChurnPlan* plan, RankList** lists, long departments, long records, uint64_t* state) {
+    plan->names = (char (*)[MAX_LINE_LEN])malloc((size_t)records * MAX_LINE_LEN);
+    plan->owners = (KeyRef*)malloc((size_t)records * sizeof(KeyRef));
+    plan->scores = (float*)malloc((size_t)records * sizeof(float));
+    if (!plan->names || !plan->owners || !plan->scores) { perror("Churn allocation failed"); exit(1); }
+    plan->programs = 0;
+    for (long d = 0; d < departments; d++) {
+        for (UniversityNode* uni = rank_list_first(lists[d]); uni != NULL; uni = uni->links[0].next, plan->programs++) {
+            strcpy(plan->names[plan->programs], uni->university_name);
+            plan->owners[plan->programs] = lists[d]->key;
+            plan->scores[plan->programs] = uni->score;
+        }
+    }
+    char (*names)[MAX_LINE_LEN] = plan->names;
+    for (long i = plan->programs - 1; i > 0; i--) {
+        long j = (long)(bench_random(state) % (uint64_t)(i + 1));
+        if (j == i) continue;
+        char name[MAX_LINE_LEN];
+        strcpy(name, names[i]); strcpy(names[i], names[j]); strcpy(names[j], name);
+        KeyRef owner = plan->owners[i]; plan->owners[i] = plan->owners[j]; plan->owners[j] = owner;
+        float score = plan->scores[i]; plan->scores[i] = plan->scores[j]; plan->scores[j] = score;
     }
 }
 
+void churn_plan_free(ChurnPlan* plan) {
+    free(plan->names);
+    free(plan->owners);
+    free(plan->scores);
+}
+
+//Checks the answers the benchmark times, on the trees both loaders build from
+//input_file: the structure, every department through each search path, every
+//program by rank and by name, batches, the score index, the frozen snapshot and
+//the tree after churn. Bulk builds by every thread count have to give the
+//serial build's tree, and deletes along the right spine of a sparse build have
+//to keep it intact. Failures go to stderr; true if there were none.
+bool run_self_test(uint64_t seed) {
+    const char* mode_names[] = {"sequential", "bulk"};
+    BatchQuery* batch = (BatchQuery*)malloc(DEFAULT_BATCH_SIZE * sizeof(BatchQuery));
+    BatchQuery** batch_sorted = (BatchQuery**)malloc(DEFAULT_BATCH_SIZE * sizeof(BatchQuery*));
+    if (!batch || !batch_sorted) { perror("Self-test allocation failed"); exit(1); }
+    printf("Self-test: %s, order %d, seed %llu\n", input_file, tree_order, (unsigned long long)seed);
+    self_test_checks = 0;
+    self_test_failures = 0;
+    BulkOptions options = {sort_threads, leaf_fill_factor, internal_fill_factor, false};
+    for (int mode = 0; mode < 2; mode++) {
+        const char* label = mode_names[mode];
+        free_tree(root);
+        free_key_store();
+        reset_metrics();
+        bool loaded = true;
+        if (mode == 0) run_sequential_insertion();
+        else loaded = run_bulk_loading_with(&options);
+        self_check(loaded && root != NULL, label, "input loads");
+        if (!loaded || root == NULL) continue;
+        int leaf_depth = -1;
+        self_check(count_tree_violations(root, 0, &leaf_depth) == 0, label, "tree structure after the load");
+
+        long departments = 0, records = 0, out_of_order = 0;
+        const char* previous = NULL;
+        for (Node* leaf = first_leaf; leaf != NULL; leaf = leaf->next) {
+            for (int i = 0; i < leaf->num_keys; i++, departments++) {
+                const char* key = key_str(leaf->keys[i]);
+                out_of_order += previous != NULL && strcmp(previous, key) >= 0;
+                previous = key;
+            }
+        }
+        self_check(out_of_order == 0, label, "departments in key order along the leaf chain");
+        const char** dept_names = (const char**)malloc((size_t)departments * sizeof(char*));
+        RankList** lists = (RankList**)malloc((size_t)departments * sizeof(RankList*));
+        if (!dept_names || !lists) { perror("Self-test allocation failed"); exit(1); }
+        long d = 0;
+        for (Node* leaf = first_leaf; leaf != NULL; leaf = leaf->next) {
+            for (int i = 0; i < leaf->num_keys; i++, d++) {
+                dept_names[d] = key_str(leaf->keys[i]);
+                lists[d] = (RankList*)leaf->pointers[i];
+                records += lists[d]->count;
+            }
+        }
+
+        //Every department through each search path, every program by rank and by name
+        long search_errors = 0, department_errors = 0, rank_errors = 0, order_errors = 0, lookup_errors = 0;
+        for (d = 0; d < departments; d++) {
+            const char* name = dept_names[d];
+            for (int prefixes = 0; prefixes < 2; prefixes++) {
+                Node* leaf = find_leaf_with(root, name, prefixes);
+                int i = node_lower_bound_with(leaf, name, prefixes);
+                search_errors += i >= leaf->num_keys || leaf->pointers[i] != lists[d];
+            }
+            department_errors += find_department_with(name, false) != lists[d];
+            if (dept_hash.count > 0) department_errors += find_department_with(name, true) != lists[d];
+            int rank = 1;
+            for (UniversityNode* uni = rank_list_first(lists[d]); uni != NULL; uni = uni->links[0].next, rank++) {
+                rank_errors += find_by_rank_with(name, rank, false) != uni;
+                rank_errors += find_by_rank(name, rank) != uni; //Fills the cache when it is on
+                rank_errors += find_by_rank(name, rank) != uni; //And hits it
+                order_errors += uni->links[0].next != NULL && uni->links[0].next->score > uni->score;
+                lookup_errors += !search_university_with(uni->university_name, name, true);
+                lookup_errors += !search_university_with(uni->university_name, name, false);
+            }
+            rank_errors += rank - 1 != lists[d]->count || find_by_rank_with(name, rank, false) != NULL;
+        }
+        char missing[MAX_LINE_LEN];
+        snprintf(missing, sizeof(missing), "%s~", dept_names[departments - 1]);
+        department_errors += find_department_with(missing, false) != NULL;
+        if (dept_hash.count > 0) department_errors += find_department_with(missing, true) != NULL;
+        self_check(search_errors == 0, label, "key search with and without key prefixes");
+        self_check(department_errors == 0, label, "department lookups via hash index and via tree");
+        self_check(rank_errors == 0, label, "rank queries with and without the rank cache");
+        self_check(order_errors == 0, label, "rankings in score order");
+        self_check(lookup_errors == 0, label, "university lookups via index and by scan");
+
+        //Batches of random rank queries, some past the end of their ranking
+        uint64_t state = seed;
+        long batch_errors = 0;
+        for (int b = 0; b < 4; b++) {
+            for (int q = 0; q < DEFAULT_BATCH_SIZE; q++) {
+                long pick = (long)(bench_random(&state) % (uint64_t)departments);
+                memset(&batch[q], 0, sizeof(BatchQuery));
+                batch[q].type = 'R';
+                strcpy(batch[q].dept_name, dept_names[pick]);
+                batch[q].rank = 1 + (int)(bench_random(&state) % (uint64_t)(lists[pick]->count + 1));
+            }
+            resolve_batch(batch, batch_sorted, DEFAULT_BATCH_SIZE);
+            for (int q = 0; q < DEFAULT_BATCH_SIZE; q++) {
+                UniversityNode* uni = find_by_rank_with(batch[q].dept_name, batch[q].rank, false);
+                if (uni == NULL) batch_errors += batch[q].result_name != NULL;
+                else batch_errors += batch[q].result_name == NULL || strcmp(batch[q].result_name, uni->university_name) != 0;
+            }
+        }
+        self_check(batch_errors == 0, label, "batched rank queries match independent ones");
+
+        //Programs within one point of a random program, via the score index and by scan
+        if (score_index.count > 0) {
+            long range_errors = 0;
+            for (int q = 0; q < 200; q++) {
+                long pick = (long)(bench_random(&state) % (uint64_t)departments);
+                float high = rank_list_at(lists[pick], 1 + (int)(bench_random(&state) % (uint64_t)lists[pick]->count))->score;
+                float low = high - 1.0f;
+                long matches[2] = {0, 0};
+                for (ScoreNode* node = score_index_seek(high); node != NULL && node->uni->score >= low; node = node->next[0]) matches[0]++;
+                for (long i = 0; i < departments; i++) {
+                    for (UniversityNode* uni = rank_list_first(lists[i]); uni != NULL && uni->score >= low; uni = uni->links[0].next) {
+                        matches[1] += uni->score <= high;
+                    }
+                }
+                range_errors += matches[0] != matches[1];
+            }
+            self_check(range_errors == 0, label, "score ranges via score index and by scan");
+        }
+
+        //The frozen snapshot holds every ranking as it is in the tree
+        if (freeze_tree(&frozen_tree)) {
+            long frozen_errors = 0;
+            for (d = 0; d < departments; d++) {
+                const PagedValue* value = frozen_find_department(&frozen_tree, dept_names[d]);
+                if (value == NULL || value->count != (uint32_t)lists[d]->count) { frozen_errors++; continue; }
+                const PagedEntry* entry = &frozen_tree.entries[value->first_entry];
+                for (UniversityNode* uni = rank_list_first(lists[d]); uni != NULL; uni = uni->links[0].next, entry++) {
+                    frozen_errors += entry->score != uni->score || strcmp(frozen_tree.strings + entry->name_offset, uni->university_name) != 0;
+                }
+            }
+            frozen_errors += frozen_find_department(&frozen_tree, missing) != NULL;
+            frozen_tree_free(&frozen_tree);
+            self_check(frozen_errors == 0, label, "frozen snapshot matches the tree");
+        }
+
+        //Churn: delete a random half of the programs and move every remaining score
+        ChurnPlan churn;
+        churn_plan(&churn, lists, departments, records, &state);
+        long deleted = 0, updated = 0;
+        char dept[MAX_LINE_LEN];
+        for (long p = 0; p < churn.programs / 2; p++) {
+            strcpy(dept, key_str(churn.owners[p]));
+            deleted += delete_program(dept, churn.names[p]);
+        }
+        for (long p = churn.programs / 2; p < churn.programs; p++) {
+            updated += update_program_score(key_str(churn.owners[p]), churn.names[p], churn.scores[p] + 1.0f);
+        }
+        self_check(deleted == churn.programs / 2, label, "every churn delete finds its program");
+        self_check(updated == churn.programs - churn.programs / 2, label, "every churn update finds its program");
+        leaf_depth = -1;
+        self_check(root == NULL || count_tree_violations(root, 0, &leaf_depth) == 0, label, "tree structure after churn");
+        long remaining = 0, churn_errors = 0;
+        for (Node* leaf = first_leaf; leaf != NULL; leaf = leaf->next) {
+            for (int i = 0; i < leaf->num_keys; i++) {
+                RankList* list = (RankList*)leaf->pointers[i];
+                churn_errors += list->count == 0 || find_by_rank(key_str(leaf->keys[i]), 1) != rank_list_first(list);
+                for (UniversityNode* uni = rank_list_first(list); uni != NULL; uni = uni->links[0].next) {
+                    churn_errors += uni->links[0].next != NULL && uni->links[0].next->score > uni->score;
+                }
+                remaining += list->count;
+            }
+        }
+        for (long p = churn.programs / 2; p < churn.programs; p++) {
+            churn_errors += !search_university_with(churn.names[p], key_str(churn.owners[p]), true);
+            churn_errors += !search_university_with(churn.names[p], key_str(churn.owners[p]), false);
+        }
+        self_check(remaining == records - deleted, label, "program count after churn");
+        self_check(churn_errors == 0, label, "queries after churn");
+        churn_plan_free(&churn);
+        free(dept_names);
+        free(lists);
+    }
+    //Bulk builds by thread count all give the serial build's tree
+    int max_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (max_threads < 4) max_threads = 4;
+    uint64_t serial_checksum = 0;
+    for (int threads = 1; threads <= max_threads; threads = next_thread_count(threads, max_threads)) {
+        free_tree(root);
+        free_key_store();
+        reset_metrics();
+        options.threads = threads;
+        bool loaded = run_bulk_loading_with(&options);
+        uint64_t checksum = tree_checksum(root);
+        if (threads == 1) serial_checksum = checksum;
+        char what[64];
+        snprintf(what, sizeof(what), "%d-thread build gives the serial tree", threads);
+        self_check(loaded && checksum == serial_checksum, "bulk", what);
+    }
+    //Deletes from the right end of a sparse bulk build, whose right spine keeps
+    //only children under keyless parents, checking the tree after each department
+    BulkOptions sparse = {sort_threads, 0.5, 0.01, false};
+    free_tree(root);
+    free_key_store();
+    reset_metrics();
+    bool loaded = run_bulk_loading_with(&sparse);
+    self_check(loaded, "spine", "sparse input loads");
+    long spine_departments = 0, violations = 0;
+    while (loaded && root != NULL && spine_departments < 1000 && violations == 0) {
+        Node* leaf = root;
+        while (!leaf->is_leaf) leaf = (Node*)leaf->pointers[leaf->num_keys];
+        RankList* list = (RankList*)leaf->pointers[leaf->num_keys - 1];
+        char dept[MAX_LINE_LEN], name[MAX_LINE_LEN];
+        bool last_program = list->count == 1;
+        strcpy(dept, key_str(list->key));
+        strcpy(name, rank_list_first(list)->university_name);
+        if (!delete_program(dept, name)) { violations++; break; }
+        if (!last_program) continue;
+        spine_departments++;
+        int leaf_depth = -1;
+        if (root != NULL) violations += count_tree_violations(root, 0, &leaf_depth);
+    }
+    self_check(violations == 0, "spine", "tree structure after deletes from the right end of a sparse build");
+    free(batch);
+    free(batch_sorted);
+    printf("Self-test: %ld checks, %ld failed.\n", self_test_checks, self_test_failures);
+    return self_test_failures == 0;
+}
 
 //Search and Calculation Functions
 
+//Accepts a byte count with an optional K, M or G suffix; 0 means invalid
+size_t parse_byte_size(const char* text) {
+    char* end;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (end == text) return 0;
+    if (*end == 'K' || *end == 'k') { value <<= 10; end++; }
+    else if (*end == 'M' || *end == 'm') { value <<= 20; end++; }
+    else if (*end == 'G' || *end == 'g') { value <<= 30; end++; }
+    if (*end == 'B' || *end == 'b') end++;
+    return *end == '\0' ? (size_t)value : 0;
+}
+
+double wall_clock_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
 void reset_metrics() {
     split_count = 0;
+    merge_count = 0;
+    borrow_count = 0;
     node_allocations = 0;
     uni_node_allocations = 0;
+    rank_list_allocations = 0;
+    uni_node_bytes = 0;
     root = NULL;
     first_leaf = NULL;
 }
 
+void calculate_key_stats(const Node* node, KeyStats* stats) {
+    size_t shared = (size_t)node->prefix_len;
+    stats->compressed_bytes += shared + 1; //The shared prefix, stored once per node
+    for (int i = 0; i < node->num_keys; i++) {
+        size_t len = strlen(key_str(node->keys[i])) + 1;
+        stats->inline_bytes += len;
+        stats->compressed_bytes += len - shared;
+        if (node->is_leaf) continue;
+        //Without truncation the separator is the smallest key of the right subtree
+        const Node* child = (const Node*)node->pointers[i + 1];
+        while (!child->is_leaf) child = (const Node*)child->pointers[0];
+        stats->separator_full_bytes += strlen(key_str(child->keys[0])) + 1;
+        stats->separator_bytes += len;
+    }
+    if (!node->is_leaf) {
+        for (int i = 0; i <= node->num_keys; i++) calculate_key_stats((const Node*)node->pointers[i], stats);
+    }
+}
+
+//Structural faults under node: keys out of order, wrong parent links, empty
+//leaves other than the root and leaves at differing depths
+long count_tree_violations(const Node* node, int depth, int* leaf_depth) {
+    long violations = node->is_leaf && node->num_keys == 0 && node != root;
+    for (int i = 1; i < node->num_keys; i++) violations += strcmp(key_str(node->keys[i - 1]), key_str(node->keys[i])) >= 0;
+    if (node->is_leaf) {
+        if (*leaf_depth < 0) *leaf_depth = depth;
+        return violations + (depth != *leaf_depth);
+    }
+    for (int i = 0; i <= node->num_keys; i++) {
+        const Node* child = (const Node*)node->pointers[i];
+        violations += child->parent != node;
+        violations += count_tree_violations(child, depth + 1, leaf_depth);
+    }
+    return violations;
+}
+
+//Order-sensitive hash of the shape, keys, fingerprints and rankings under node.
+//Equal checksums mean equal trees, wherever the keys sit in key_store.
+uint64_t tree_checksum(const Node* node) {
+    uint64_t hash = 14695981039346656037ULL;
+    if (node == NULL) return hash;
+    hash = (hash ^ ((uint64_t)node->num_keys << 1 | node->is_leaf)) * 1099511628211ULL;
+    hash = (hash ^ (uint64_t)node->prefix_len) * 1099511628211ULL;
+    for (int i = 0; i < node->num_keys; i++) {
+        hash = (hash ^ hash_key(key_str(node->keys[i]))) * 1099511628211ULL;
+        hash = (hash ^ node->prefixes[i]) * 1099511628211ULL;
+        if (!node->is_leaf) continue;
+        const RankList* list = (const RankList*)node->pointers[i];
+        hash = (hash ^ ((uint64_t)list->count << 8 | (uint64_t)list->level)) * 1099511628211ULL;
+        for (const UniversityNode* uni = rank_list_first(list); uni != NULL; uni = uni->links[0].next) {
+            uint32_t score_bits;
+            memcpy(&score_bits, &uni->score, sizeof(score_bits));
+            hash = (hash ^ hash_key(uni->university_name)) * 1099511628211ULL;
+            hash = (hash ^ ((uint64_t)score_bits << 8 | (uint64_t)uni->level)) * 1099511628211ULL;
+        }
+    }
+    if (!node->is_leaf) {
+        for (int i = 0; i <= node->num_keys; i++) hash = (hash ^ tree_checksum((const Node*)node->pointers[i])) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+void calculate_fill_stats(const Node* node, FillStats* stats) {
+    if (node->is_leaf) {
+        stats->leaves++;
+        stats->leaf_keys += node->num_keys;
+        stats->underfull += node != root && node->num_keys < tree_order / 2;
+        return;
+    }
+    stats->internals++;
+    stats->internal_keys += node->num_keys;
+    stats->underfull += node != root && node->num_keys < (tree_order + 1) / 2 - 1;
+    for (int i = 0; i <= node->num_keys; i++) calculate_fill_stats((const Node*)node->pointers[i], stats);
+}
+
 int calculate_tree_height() {
     int height = 0;
+    if (paged_index.base) return (int)paged_index.header->height;
+    if (frozen_tree.nodes) return (int)frozen_tree.height;
     if (root == NULL) return 0;
     Node* ptr = root;
     while (ptr && !ptr->is_leaf) {
@@ -591,84 +5372,137 @@ int calculate_tree_height() {
 }
 
 double calculate_memory_usage() {
-    double total_memory = (double)(node_allocations * sizeof(Node)) + 
-                          (double)(uni_node_allocations * sizeof(UniversityNode));
+    double total_memory = (double)(dept_hash.capacity * sizeof(DeptHashSlot)) +
+                          (double)(uni_index.capacity * sizeof(UniEntry) + uni_index.program_bytes) +
+                          (double)(rank_cache.set_count * (RANK_CACHE_WAYS * sizeof(RankCacheEntry) + 1));
+    if (paged_index.base) {
+        total_memory += (double)paged_index.size; //Mapped, paged in on demand
+    } else if (frozen_tree.nodes) {
+        total_memory += (double)frozen_tree_bytes(&frozen_tree);
+    } else if (use_arena) {
+        total_memory += (double)(node_arena.reserved + uni_arena.reserved + key_store.capacity);
+    } else {
+        total_memory += (double)score_index.bytes; //Counted in uni_arena when arenas are on
+        total_memory += (double)(node_allocations * node_size) +
+                       (double)uni_node_bytes +
+                       (double)(rank_list_allocations * sizeof(RankList)) +
+                       (double)key_store.capacity;
+    }
     return total_memory / (1024.0 * 1024.0); // In MB
 }
 
-void search_department_by_rank(const char* dept_name, int rank) {
+//Ranking of a department in the in-memory tree, or NULL. Exact lookups go
+//through the hash index when it is enabled and descend the tree otherwise.
+RankList* find_department(const char* dept_name) {
+    return find_department_with(dept_name, use_hash_index);
+}
+
+RankList* find_department_with(const char* dept_name, bool use_hash) {
+    if (use_hash) return dept_hash_find(dept_name);
     Node* leaf = find_leaf(root, dept_name);
-    if (leaf == NULL) {
-        printf("Department '%s' not found.\n", dept_name);
-        return;
-    }
+    if (leaf == NULL) return NULL;
+    int i = node_lower_bound(leaf, dept_name);
+    if (i < leaf->num_keys && strcmp(key_str(leaf->keys[i]), dept_name) == 0) return (RankList*)leaf->pointers[i];
+    return NULL;
+}
 
-    for (int i = 0; i < leaf->num_keys; i++) {
-        if (strcmp(leaf->keys[i], dept_name) == 0) {
-            UniversityNode* current = (UniversityNode*)leaf->pointers[i];
-            int current_rank = 1;
-            while(current != NULL && current_rank < rank) {
-                current = current->next;
-                current_rank++;
-            }
+//Rank-th university (1-based) of a department in the in-memory tree, or NULL.
+//Only delete_program frees entries, so the result stays valid after the lock
+//is released unless the program is deleted.
+UniversityNode* find_by_rank(const char* dept_name, int rank) {
+    return find_by_rank_with(dept_name, rank, rank_cache_enabled());
+}
 
-            if (current != NULL && current_rank == rank) {
-                printf("%s with the base placement score %.2f.\n\n", current->university_name, current->score);
-            } else {
-                printf("Rank %d not found in department '%s'.\n", rank, dept_name);
-            }
-            return;
+//cached must stay false while queries run concurrently without the lock
+UniversityNode* find_by_rank_with(const char* dept_name, int rank, bool cached) {
+    tree_read_lock();
+    UniversityNode* uni = lookup_rank(dept_name, rank, cached, NULL);
+    tree_read_unlock();
+    return uni;
+}
+
+void search_department_by_rank(const char* dept_name, int rank) {
+    if (readonly_layout()) {
+        const PagedEntry* entries;
+        const char* strings;
+        const PagedValue* value = readonly_find_department(dept_name, &entries, &strings);
+        if (value == NULL) {
+            printf("Department '%s' not found.\n", dept_name);
+        } else if (rank < 1 || (uint32_t)rank > value->count) {
+            printf("Rank %d not found in department '%s'.\n", rank, dept_name);
+        } else {
+            const PagedEntry* entry = &entries[value->first_entry + rank - 1];
+            printf("%s with the base placement score %.2f.\n\n", readonly_string(strings, entry->name_offset), entry->score);
         }
+        return;
+    }
+    tree_read_lock();
+    bool department_found;
+    UniversityNode* current = lookup_rank(dept_name, rank, rank_cache_enabled(), &department_found);
+    if (current != NULL) {
+        printf("%s with the base placement score %.2f.\n\n", current->university_name, current->score);
+    } else if (department_found) {
+        printf("Rank %d not found in department '%s'.\n", rank, dept_name);
+    } else {
+        printf("Department '%s' not found.\n", dept_name);
     }
-    printf("Department '%s' not found.\n", dept_name);
+    tree_read_unlock();
 }
 
-void search_university(const char* uni_name, const char* dept_name) {
-    Node* leaf = find_leaf(root, dept_name);
-    if (leaf == NULL) {
-        //printf("Department '%s' not found.\n", dept_name);
-        return;
+bool search_university(const char* uni_name, const char* dept_name) {
+    if (readonly_layout()) {
+        const PagedEntry* entries;
+        const char* strings;
+        const PagedValue* value = readonly_find_department(dept_name, &entries, &strings);
+        if (value == NULL) return false;
+        for (uint32_t i = 0; i < value->count; i++) {
+            if (strcmp(readonly_string(strings, entries[value->first_entry + i].name_offset), uni_name) == 0) return true;
+        }
+        return false;
     }
+    return search_university_with(uni_name, dept_name, use_university_index);
+}
 
-    for (int i = 0; i < leaf->num_keys; i++) {
-        if (strcmp(leaf->keys[i], dept_name) == 0) {
-            UniversityNode* current = (UniversityNode*)leaf->pointers[i];
-            while(current != NULL) {
-                if (strcmp(current->university_name, uni_name) == 0) {
-                    //printf("%s with the base placement score %.2f.\n\n", current->university_name, current->score);
-                    return;
-                }
-                current = current->next;
-            }
-            //printf("University '%s' not found in department '%s'.\n", uni_name, dept_name);
-            return;
+//Membership on the in-memory tree, through the university index when use_index
+//is set and the index is built, by scanning the ranking otherwise
+bool search_university_with(const char* uni_name, const char* dept_name, bool use_index) {
+    tree_read_lock();
+    bool found = false;
+    RankList* list = find_department(dept_name);
+    if (use_index && uni_index.count > 0) {
+        //Binary search among the university's programs instead of scanning the department
+        UniEntry* entry = list != NULL ? uni_index_find(uni_name) : NULL;
+        if (entry != NULL) {
+            int i = uni_programs_bound(entry, list->key, true);
+            found = i < entry->count && entry->programs[i].dept == list->key;
+        }
+    } else if (list != NULL) {
+        for (UniversityNode* current = rank_list_first(list); current != NULL && !found; current = current->links[0].next) {
+            found = strcmp(current->university_name, uni_name) == 0;
         }
     }
-    //printf("Department '%s' not found.\n", dept_name);
+    tree_read_unlock();
+    return found;
 }
 
 double calculate_average_seek_time(const char* filename) {
-    if (root == NULL) {
+    if (root == NULL && !readonly_layout()) {
         printf("Tree is empty. No seek time to calculate.\n");
         return 0;
     }
     clock_t start, end;
-    FILE* file = fopen(filename, "r");
-    if (!file) { perror("Could not open file"); return 0; }
-    char line[512];
-    fgets(line, sizeof(line), file);
+    CsvReader reader;
+    if (!csv_open(&reader, filename)) { perror("Could not open file"); return 0; }
+    CsvField header[CSV_MAX_FIELDS];
+    csv_next_record(&reader, header, CSV_MAX_FIELDS);
 
     start = clock();
-    while (fgets(line, sizeof(line), file)) {
-        char id[MAX_LINE_LEN], uni_name[MAX_LINE_LEN], dept_name[MAX_LINE_LEN];
-        float score = 0.0;
-        sscanf(line, "%[^,],%[^,],%[^,],%f", id, uni_name, dept_name, &score);
-        if (strlen(dept_name) > 0 && strlen(uni_name) > 0) {
-            search_university(uni_name, dept_name);
-            total_record++;
-        }
+    Record record;
+    while (csv_read_record(&reader, &record, 1)) {
+        search_university(record.uni_name, record.dept_name);
+        total_record++;
     }
     end = clock();
-    fclose(file);
+    csv_close(&reader);
     return ((double)(end - start)) / CLOCKS_PER_SEC / total_record;
 }
\ No newline at end of file